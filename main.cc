@@ -27,12 +27,14 @@
 #include <iostream>
 #include <string>
 #include <memory>
+#include <algorithm>
 #include <cstdlib>
 #include <libgen.h>
 #include "pkgutil.h"
 #include "pkgadd.h"
 #include "pkgrm.h"
 #include "pkginfo.h"
+#include "pkgutild.h"
 
 using namespace std;
 
@@ -44,6 +46,8 @@ static pkgutil* select_utility(const string& name)
 		return new pkgrm;
 	else if (name == "pkginfo")
 		return new pkginfo;
+	else if (name == "pkgutild")
+		return new pkgutild;
 	else
 		throw runtime_error("command not supported by pkgutils");
 }
@@ -51,6 +55,8 @@ static pkgutil* select_utility(const string& name)
 int main(int argc, char** argv)
 {
 	string name = basename(argv[0]);
+	pkg_stats::format_t stats = pkg_stats::NONE;
+	int status = EXIT_SUCCESS;
 
 	try {
 		auto_ptr<pkgutil> util(select_utility(name));
@@ -64,14 +70,24 @@ int main(int argc, char** argv)
 			} else if (option == "-h" || option == "--help") {
 				util->print_help();
 				return EXIT_SUCCESS;
+			} else if (option == "--stats" || option == "--stats=text" || option == "--stats=json") {
+				stats = option == "--stats=json" ? pkg_stats::JSON : pkg_stats::TEXT;
+				// The utility itself never sees the option
+				copy(argv + i + 1, argv + argc + 1, argv + i);
+				argc--;
+				i--;
 			}
 		}
 
+		pkg_stats::start();
 		util->run(argc, argv);
 	} catch (runtime_error& e) {
 		cerr << name << ": " << e.what() << endl;
-		return EXIT_FAILURE;
+		status = EXIT_FAILURE;
 	}
 
-	return EXIT_SUCCESS;
+	if (stats != pkg_stats::NONE)
+		pkg_stats::report(cerr, stats, name, status);
+
+	return status;
 }
@@ -24,18 +24,45 @@
 #include <fstream>
 #include <iterator>
 #include <cstdio>
+#include <cstdlib>
+#include <cctype>
 #include <regex.h>
 #include <unistd.h>
 
+pkgadd::pkgadd()
+	: pkgutil("pkgadd")
+{
+	any_rule[UPGRADE] = 0;
+	any_rule[INSTALL] = 0;
+}
+
+pkgadd::~pkgadd()
+{
+	for (vector<rule_t>::iterator i = rules.begin(); i != rules.end(); i++) {
+		if (i->regex) {
+			regfree(i->regex);
+			delete i->regex;
+		}
+	}
+
+	for (int event = UPGRADE; event <= INSTALL; event++) {
+		if (any_rule[event]) {
+			regfree(any_rule[event]);
+			delete any_rule[event];
+		}
+	}
+}
+
 void pkgadd::run(int argc, char** argv)
 {
 	//
 	// Check command line options
 	//
 	string o_root;
-	string o_package;
+	vector<string> o_packages;
 	bool o_upgrade = false;
 	bool o_force = false;
+	unsigned int o_wait = 0;
 
 	for (int i = 1; i < argc; i++) {
 		string option(argv[i]);
@@ -47,14 +74,36 @@ void pkgadd::run(int argc, char** argv)
 			o_upgrade = true;
 		} else if (option == "-f" || option == "--force") {
 			o_force = true;
-		} else if (option[0] == '-' || !o_package.empty()) {
+		} else if (option == "-F" || option == "--from-file") {
+			assert_argument(argv, argc, i);
+			read_package_list(argv[i + 1], o_packages);
+			i++;
+		} else if (option == "-j" || option == "--jobs") {
+			assert_argument(argv, argc, i);
+			char* end;
+			long n = strtol(argv[i + 1], &end, 10);
+			if (*end || n < 1 || n > MAX_JOBS)
+				throw runtime_error("invalid number of jobs " + string(argv[i + 1]));
+			jobs = n;
+			i++;
+		} else if (option == "-d" || option == "--defer-ldconfig") {
+			defer_ldconfig = true;
+		} else if (option == "-w" || option == "--wait") {
+			assert_argument(argv, argc, i);
+			char* end;
+			long n = strtol(argv[i + 1], &end, 10);
+			if (*end || n < 0)
+				throw runtime_error("invalid number of seconds " + string(argv[i + 1]));
+			o_wait = n;
+			i++;
+		} else if (option[0] == '-') {
 			throw runtime_error("invalid option " + option);
 		} else {
-			o_package = option;
+			o_packages.push_back(option);
 		}
 	}
 
-	if (o_package.empty())
+	if (o_packages.empty())
 		throw runtime_error("option missing");
 
 	//
@@ -64,64 +113,250 @@ void pkgadd::run(int argc, char** argv)
 		throw runtime_error("only root can install/upgrade packages");
 
 	//
-	// Install/upgrade package
+	// Install/upgrade packages
 	//
 	{
-		db_lock lock(o_root, true);
+		db_lock lock(o_root, true, o_wait);
 		db_open(o_root);
 
-		pair<string, pkginfo_t> package = pkg_open(o_package);
-		vector<rule_t> config_rules = read_config();
-
-		bool installed = db_find_pkg(package.first);
-		if (installed && !o_upgrade)
-			throw runtime_error("package " + package.first + " already installed (use -u to upgrade)");
-		else if (!installed && o_upgrade)
-			throw runtime_error("package " + package.first + " not previously installed (skip -u to install)");
-      
-		set<string> non_install_files = apply_install_rules(package.first, package.second, config_rules);
-		set<string> conflicting_files = db_find_conflicts(package.first, package.second);
-      
-		if (!conflicting_files.empty()) {
-			if (o_force) {
-				set<string> keep_list;
-				if (o_upgrade) // Don't remove files matching the rules in configuration
-					keep_list = make_keep_list(conflicting_files, config_rules);
-				db_rm_files(conflicting_files, keep_list); // Remove unwanted conflicts
-			} else {
-				copy(conflicting_files.begin(), conflicting_files.end(), ostream_iterator<string>(cerr, "\n"));
+		pkg_stage stage(trim_filename(o_root + string("/") + PKG_DIR), utilname);
+		vector<string> staged_packages;
+		read_config();
+		vector<pair<string, pkginfo_t> > batch;
+		vector<set<string> > non_install_files;
+		vector<file_sums_t> installed_sums;
+		set<string> names;
+
+		// A single package is staged while its member list is read, so
+		// that it is inflated only once. The packages of a batch are only
+		// listed here and read again as each is installed, so that there
+		// is never more than one uncompressed copy under the root, unless
+		// deltas without a full package next to them are in the batch.
+		const bool stage_ahead = o_packages.size() == 1;
+
+		for (vector<string>::iterator i = o_packages.begin(); i != o_packages.end(); ++i) {
+			string staged = stage_ahead ? stage.create() : "";
+			pair<string, pkginfo_t> package = pkg_is_delta(*i) ? open_delta(*i, stage, staged) : pkg_open(*i, staged);
+			staged_packages.push_back(staged);
+
+			bool installed = db_find_pkg(package.first);
+			if (installed && !o_upgrade)
+				throw runtime_error("package " + package.first + " already installed (use -u to upgrade)");
+			else if (!installed && o_upgrade)
+				throw runtime_error("package " + package.first + " not previously installed (skip -u to install)");
+			if (!names.insert(package.first).second)
+				throw runtime_error("package " + package.first + " listed more than once");
+
+			non_install_files.push_back(apply_install_rules(package.first, package.second));
+			installed_sums.push_back(file_sums_t());
+			if (installed)
+				db_read_sums(package.first, packages[package.first].version, installed_sums.back());
+			batch.push_back(package);
+		}
+
+		//
+		// Resolve conflicts for the whole batch before anything is changed
+		//
+		vector<set<string> > conflicting_files = find_batch_conflicts(batch);
+		if (!o_force) {
+			set<string> all_conflicts;
+			for (vector<set<string> >::const_iterator i = conflicting_files.begin(); i != conflicting_files.end(); ++i)
+				all_conflicts.insert(i->begin(), i->end());
+
+			if (!all_conflicts.empty()) {
+				copy(all_conflicts.begin(), all_conflicts.end(), ostream_iterator<string>(cerr, "\n"));
 				throw runtime_error("listed file(s) already installed (use -f to ignore and overwrite)");
 			}
 		}
-   
-		set<string> keep_list;
 
-		if (o_upgrade) {
-			keep_list = make_keep_list(package.second.files, config_rules);
-			db_rm_pkg(package.first, keep_list);
+		// A delta that failed to rebuild once the database is committed
+		// would leave it naming a version whose files were never
+		// installed. Deltas with no full package to fall back on are
+		// therefore rebuilt now, before anything is changed, and stay
+		// staged until they are installed
+		for (vector<pair<string, pkginfo_t> >::size_type i = 0; i < batch.size(); ++i)
+			if (staged_packages[i].empty() && pkg_is_delta(o_packages[i]) && pkg_full_package(o_packages[i]).empty())
+				staged_packages[i] = rebuild_delta(o_packages[i], stage);
+
+		vector<set<string> > keep_lists(batch.size());
+
+		for (vector<pair<string, pkginfo_t> >::size_type i = 0; i < batch.size(); ++i) {
+			if (!conflicting_files[i].empty()) {
+				set<string> keep_list;
+				if (o_upgrade) // Don't remove files matching the rules in configuration
+					keep_list = make_keep_list(conflicting_files[i]);
+				db_rm_files(conflicting_files[i], keep_list); // Remove unwanted conflicts
+			}
+
+			if (o_upgrade) {
+				keep_lists[i] = make_keep_list(batch[i].second.files);
+
+				// Files with a recorded sum that the new version also
+				// installs are replaced by pkg_install, or left alone
+				// when they are unchanged
+				set<string> keep_files = keep_lists[i];
+				for (file_sums_t::const_iterator j = installed_sums[i].begin(); j != installed_sums[i].end(); ++j)
+					if (batch[i].second.files.find(j->first) != batch[i].second.files.end())
+						keep_files.insert(j->first);
+
+				// A delta that is rebuilt when it is installed needs the
+				// files of the installed version until then
+				if (staged_packages[i].empty() && pkg_is_delta(o_packages[i]))
+					keep_files.insert(batch[i].second.files.begin(), batch[i].second.files.end());
+				db_rm_pkg(batch[i].first, keep_files);
+			}
+
+			db_add_pkg(batch[i].first, batch[i].second);
 		}
-   
-		db_add_pkg(package.first, package.second);
+
 		db_commit();
-		pkg_install(o_package, keep_list, non_install_files);
+
+		for (vector<pair<string, pkginfo_t> >::size_type i = 0; i < batch.size(); ++i) {
+			file_sums_t sums;
+			if (staged_packages[i].empty() && pkg_is_delta(o_packages[i]))
+				staged_packages[i] = rebuild_delta(o_packages[i], stage);
+			if (staged_packages[i].empty()) {
+				pkg_install(o_packages[i], keep_lists[i], non_install_files[i], installed_sums[i], sums);
+			} else {
+				pkg_install(staged_packages[i], keep_lists[i], non_install_files[i], installed_sums[i], sums);
+				stage.remove(staged_packages[i]);
+			}
+
+			// The package is installed at this point, missing sums
+			// only mean that it cannot be verified
+			try {
+				db_write_sums(batch[i].first, batch[i].second.version, sums);
+			} catch (runtime_error& e) {
+				cerr << utilname << ": " << e.what() << endl;
+			}
+		}
+
 		ldconfig();
 	}
 }
 
 void pkgadd::print_help() const
 {
-	cout << "usage: " << utilname << " [options] <file>" << endl
+	cout << "usage: " << utilname << " [options] <file> [<file> ...]" << endl
 	     << "options:" << endl
-	     << "  -u, --upgrade       upgrade package with the same name" << endl
-	     << "  -f, --force         force install, overwrite conflicting files" << endl
-	     << "  -r, --root <path>   specify alternative installation root" << endl
-	     << "  -v, --version       print version and exit" << endl
-	     << "  -h, --help          print help and exit" << endl;
+	     << "  -u, --upgrade            upgrade packages with the same name" << endl
+	     << "  -f, --force              force install, overwrite conflicting files" << endl
+	     << "  -F, --from-file <list>   read package files from <list>, one per line" << endl
+	     << "  -j, --jobs <number>      number of threads writing files (default: number of CPUs)" << endl
+	     << "  -d, --defer-ldconfig     leave running ldconfig to a later pkgadd or pkgrm" << endl
+	     << "  -w, --wait <seconds>     wait for the database lock held by another process" << endl
+	     << "  -r, --root <path>        specify alternative installation root" << endl
+	     << "  --stats[=json]           print time per phase and counters when done" << endl
+	     << "  -v, --version            print version and exit" << endl
+	     << "  -h, --help               print help and exit" << endl;
 }
 
-vector<rule_t> pkgadd::read_config() const
+//
+// Opens a delta package, or the full package next to it when the delta
+// does not apply to the installed version.
+//
+pair<string, pkgutil::pkginfo_t> pkgadd::open_delta(string& filename, pkg_stage& stage, string& staged)
+{
+	const string full = pkg_full_package(filename);
+
+	try {
+		return pkg_open_delta(filename, stage, staged);
+	} catch (runtime_error& e) {
+		if (full.empty())
+			throw;
+		cerr << utilname << ": " << e.what() << ", using " << full << endl;
+	}
+
+	filename = full;
+	return pkg_open(filename, staged);
+}
+
+//
+// Rebuilds a delta package that was only checked when it was opened, once
+// it is its turn to be installed. Returns the staged package, or nothing
+// with filename set to the full package next to the delta when the delta
+// could not be rebuilt.
+//
+string pkgadd::rebuild_delta(string& filename, pkg_stage& stage)
+{
+	const string staged = stage.create();
+
+	try {
+		if (staged.empty())
+			throw runtime_error("could not stage " + filename);
+		pkg_rebuild_delta(filename, stage, staged);
+		return staged;
+	} catch (runtime_error& e) {
+		stage.remove(staged);
+		const string full = pkg_full_package(filename);
+		if (full.empty())
+			throw;
+		cerr << utilname << ": " << e.what() << ", using " << full << endl;
+		filename = full;
+	}
+
+	return "";
+}
+
+void pkgadd::read_package_list(const string& filename, vector<string>& packages) const
+{
+	ifstream in(filename.c_str());
+	if (!in)
+		throw runtime_error_with_errno("could not open " + filename);
+
+	while (!in.eof()) {
+		string line;
+		getline(in, line);
+		if (!line.empty() && line[0] != '#')
+			packages.push_back(line);
+	}
+}
+
+vector<set<string> > pkgadd::find_batch_conflicts(const vector<pair<string, pkginfo_t> >& batch)
+{
+	vector<set<string> > conflicts;
+	map<string, string> batch_files;
+
+	for (vector<pair<string, pkginfo_t> >::const_iterator i = batch.begin(); i != batch.end(); ++i) {
+		set<string> files = db_find_conflicts(i->first, i->second);
+
+		// Files owned only by packages that are upgraded in this
+		// batch and dropped by their new version are going away
+		for (set<string>::iterator j = files.begin(); j != files.end();) {
+			set<string> owners;
+			db_find_owners(*j, owners);
+			owners.erase(i->first);
+
+			bool dropped = !owners.empty();
+			for (set<string>::const_iterator k = owners.begin(); dropped && k != owners.end(); ++k) {
+				vector<pair<string, pkginfo_t> >::const_iterator upgraded = batch.begin();
+				while (upgraded != batch.end() && upgraded->first != *k)
+					++upgraded;
+				dropped = upgraded != batch.end() && upgraded->second.files.find(*j) == upgraded->second.files.end();
+			}
+
+			if (dropped)
+				files.erase(j++);
+			else
+				++j;
+		}
+
+		// Files provided by more than one package in this batch
+		for (file_list::const_iterator j = i->second.files.begin(); j != i->second.files.end(); ++j) {
+			if ((*j)[strlen(*j) - 1] == '/')
+				continue;
+			if (!batch_files.insert(make_pair(*j, i->first)).second)
+				files.insert(*j);
+		}
+
+		conflicts.push_back(files);
+	}
+
+	return conflicts;
+}
+
+void pkgadd::read_config()
 {
-	vector<rule_t> rules;
 	unsigned int linecount = 0;
 	const string filename = root + PKGADD_CONF;
 	ifstream in(filename.c_str());
@@ -146,6 +381,7 @@ vector<rule_t> pkgadd::read_config() const
 					rule_t rule;
 					rule.event = strcmp(event, "UPGRADE") ? INSTALL : UPGRADE;
 					rule.pattern = pattern;
+					rule.regex = 0;
 					if (!strcmp(action, "YES")) {
 						rule.action = true;
 					} else if (!strcmp(action, "NO")) {
@@ -171,25 +407,25 @@ vector<rule_t> pkgadd::read_config() const
 	cerr << endl;
 #endif
 
-	return rules;
+	compile_rules();
 }
 
-set<string> pkgadd::make_keep_list(const set<string>& files, const vector<rule_t>& rules) const
+set<string> pkgadd::make_keep_list(const set<string>& files) const
 {
-	set<string> keep_list;
-	vector<rule_t> found;
-
-	find_rules(rules, UPGRADE, found);
+	file_list list;
+	for (set<string>::const_iterator i = files.begin(); i != files.end(); i++)
+		list.insert(*i);
+	return make_keep_list(list);
+}
 
-	for (set<string>::const_iterator i = files.begin(); i != files.end(); i++) {
-		for (vector<rule_t>::reverse_iterator j = found.rbegin(); j != found.rend(); j++) {
-			if (rule_applies_to_file(*j, *i)) {
-				if (!(*j).action)
-					keep_list.insert(keep_list.end(), *i);
+set<string> pkgadd::make_keep_list(const file_list& files) const
+{
+	set<string> keep_list;
 
-				break;
-			}
-		}
+	for (file_list::const_iterator i = files.begin(); i != files.end(); i++) {
+		const rule_t* rule = find_rule(UPGRADE, *i);
+		if (rule && !rule->action)
+			keep_list.insert(keep_list.end(), *i);
 	}
 
 #ifndef NDEBUG
@@ -203,37 +439,26 @@ set<string> pkgadd::make_keep_list(const set<string>& files, const vector<rule_t
 	return keep_list;
 }
 
-set<string> pkgadd::apply_install_rules(const string& name, pkginfo_t& info, const vector<rule_t>& rules)
+set<string> pkgadd::apply_install_rules(const string& name, pkginfo_t& info)
 {
-	// TODO: better algo(?)
-	set<string> install_set;
+	file_list install_set;
 	set<string> non_install_set;
-	vector<rule_t> found;
 
-	find_rules(rules, INSTALL, found);
-
-	for (set<string>::const_iterator i = info.files.begin(); i != info.files.end(); i++) {
-		bool install_file = true;
-
-		for (vector<rule_t>::reverse_iterator j = found.rbegin(); j != found.rend(); j++) {
-			if (rule_applies_to_file(*j, *i)) {
-				install_file = (*j).action;
-				break;
-			}
-		}
+	for (file_list::const_iterator i = info.files.begin(); i != info.files.end(); i++) {
+		const rule_t* rule = find_rule(INSTALL, *i);
+		bool install_file = rule ? rule->action : true;
 
 		if (install_file)
-			install_set.insert(install_set.end(), *i);
+			install_set.insert(*i);
 		else
 			non_install_set.insert(*i);
 	}
 
-	info.files.clear();
-	info.files = install_set;
+	info.files.swap(install_set);
 
 #ifndef NDEBUG
 	cerr << "Install set:" << endl;
-	for (set<string>::iterator j = info.files.begin(); j != info.files.end(); j++) {
+	for (file_list::const_iterator j = info.files.begin(); j != info.files.end(); j++) {
 		cerr << "   " << (*j) << endl;
 	}
 	cerr << endl;
@@ -248,23 +473,54 @@ set<string> pkgadd::apply_install_rules(const string& name, pkginfo_t& info, con
 	return non_install_set;
 }
 
-void pkgadd::find_rules(const vector<rule_t>& rules, rule_event_t event, vector<rule_t>& found) const
+void pkgadd::compile_rules()
 {
-	for (vector<rule_t>::const_iterator i = rules.begin(); i != rules.end(); i++)
-		if (i->event == event)
-			found.push_back(*i);
+	for (vector<rule_t>::iterator i = rules.begin(); i != rules.end(); i++) {
+		i->regex = new regex_t;
+		if (regcomp(i->regex, i->pattern.c_str(), REG_EXTENDED | REG_NOSUB)) {
+			delete i->regex;
+			i->regex = 0;
+			throw runtime_error("error compiling regular expression '" + i->pattern + "', aborting");
+		}
+	}
+
+	for (int event = UPGRADE; event <= INSTALL; event++) {
+		string combined;
+		unsigned int count = 0;
+		bool combinable = true;
+
+		for (vector<rule_t>::const_iterator i = rules.begin(); i != rules.end(); i++) {
+			if (i->event != event)
+				continue;
+
+			// Back-references would be renumbered by the extra groups
+			for (string::size_type j = i->pattern.find('\\'); j != string::npos; j = i->pattern.find('\\', j + 2))
+				if (j + 1 < i->pattern.length() && isdigit(i->pattern[j + 1]))
+					combinable = false;
+
+			combined += (count++ ? "|(" : "(") + i->pattern + ")";
+		}
+
+		if (count < 2 || !combinable)
+			continue;
+
+		any_rule[event] = new regex_t;
+		if (regcomp(any_rule[event], combined.c_str(), REG_EXTENDED | REG_NOSUB)) {
+			delete any_rule[event];
+			any_rule[event] = 0;
+		}
+	}
 }
 
-bool pkgadd::rule_applies_to_file(const rule_t& rule, const string& file) const
+const rule_t* pkgadd::find_rule(rule_event_t event, const string& file) const
 {
-	regex_t preg;
-	bool ret;
-
-	if (regcomp(&preg, rule.pattern.c_str(), REG_EXTENDED | REG_NOSUB))
-		throw runtime_error("error compiling regular expression '" + rule.pattern + "', aborting");
+	if (any_rule[event] && regexec(any_rule[event], file.c_str(), 0, 0, 0))
+		return 0;
 
-	ret = !regexec(&preg, file.c_str(), 0, 0, 0);
-	regfree(&preg);
+	// The last matching rule has the highest priority
+	for (vector<rule_t>::const_reverse_iterator i = rules.rbegin(); i != rules.rend(); i++)
+		if (i->event == event && !regexec(i->regex, file.c_str(), 0, 0, 0))
+			return &*i;
 
-	return ret;
+	return 0;
 }
@@ -26,6 +26,8 @@
 #include "pkgutil.h"
 #include <vector>
 #include <set>
+#include <map>
+#include <regex.h>
 
 #define PKGADD_CONF             "/etc/pkgadd.conf"
 #define PKGADD_CONF_MAXLINE     1024
@@ -39,20 +41,33 @@ struct rule_t {
 	rule_event_t event;
 	string pattern;
 	bool action;
+	regex_t* regex;
 };
 
 class pkgadd : public pkgutil {
 public:
-	pkgadd() : pkgutil("pkgadd") {}
+	pkgadd();
+	virtual ~pkgadd();
 	virtual void run(int argc, char** argv);
 	virtual void print_help() const;
 
 private:
-	vector<rule_t> read_config() const;
-	set<string> make_keep_list(const set<string>& files, const vector<rule_t>& rules) const;
-	set<string> apply_install_rules(const string& name, pkginfo_t& info, const vector<rule_t>& rules);
-	void find_rules(const vector<rule_t>& rules, rule_event_t event, vector<rule_t>& found) const;
-	bool rule_applies_to_file(const rule_t& rule, const string& file) const;
+	void read_config();
+	void read_package_list(const string& filename, vector<string>& packages) const;
+	pair<string, pkginfo_t> open_delta(string& filename, pkg_stage& stage, string& staged);
+	string rebuild_delta(string& filename, pkg_stage& stage);
+	vector<set<string> > find_batch_conflicts(const vector<pair<string, pkginfo_t> >& batch);
+	set<string> make_keep_list(const set<string>& files) const;
+	set<string> make_keep_list(const file_list& files) const;
+	set<string> apply_install_rules(const string& name, pkginfo_t& info);
+	void compile_rules();
+	const rule_t* find_rule(rule_event_t event, const string& file) const;
+
+	// Rules are compiled once when the configuration is read. All
+	// patterns of an event are also combined into one alternation,
+	// which rejects files not matching any rule in a single pass.
+	vector<rule_t> rules;
+	regex_t* any_rule[2];
 };
 
 #endif /* PKGADD_H */
@@ -0,0 +1,405 @@
+//
+//  pkgutils
+// 
+//  Copyright (c) 2000-2005 Per Liden
+//  Copyright (c) 2006-2007 by CRUX team (http://crux.nu)
+// 
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+//
+
+#include "pkgbench.h"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iterator>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <archive.h>
+#include <archive_entry.h>
+
+static unsigned long long now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int number_argument(char** argv, int argc, int index)
+{
+	assert_argument(argv, argc, index);
+	char* end;
+	long value = strtol(argv[index + 1], &end, 10);
+	if (*end || value < 1)
+		throw runtime_error("invalid number " + string(argv[index + 1]));
+	return value;
+}
+
+static int remove_entry(const char* path, const struct stat*, int, struct FTW*)
+{
+	return remove(path);
+}
+
+pkgbench::pkgbench()
+	: pkgutil("pkgbench"), nfiles(100000), npackages(1000),
+	  narchive_files(2000), iterations(5)
+{
+}
+
+void pkgbench::run(int argc, char** argv)
+{
+	//
+	// Check command line options
+	//
+	for (int i = 1; i < argc; i++) {
+		string option(argv[i]);
+		if (option == "-r" || option == "--root") {
+			assert_argument(argv, argc, i);
+			bench_root = argv[i + 1];
+			i++;
+		} else if (option == "-f" || option == "--files") {
+			nfiles = number_argument(argv, argc, i);
+			i++;
+		} else if (option == "-p" || option == "--packages") {
+			npackages = number_argument(argv, argc, i);
+			i++;
+		} else if (option == "-a" || option == "--archive-files") {
+			narchive_files = number_argument(argv, argc, i);
+			i++;
+		} else if (option == "-n" || option == "--iterations") {
+			iterations = number_argument(argv, argc, i);
+			i++;
+		} else if (option == "-j" || option == "--jobs") {
+			jobs = number_argument(argv, argc, i);
+			if (jobs > MAX_JOBS)
+				throw runtime_error("invalid number of jobs " + string(argv[i + 1]));
+			i++;
+		} else {
+			throw runtime_error("invalid option " + option);
+		}
+	}
+
+	if (npackages > nfiles)
+		throw runtime_error("more packages than files");
+
+	//
+	// Create scratch root, removed afterwards unless given
+	//
+	bool temporary = bench_root.empty();
+	if (temporary) {
+		char dir[] = "/tmp/pkgbench.XXXXXX";
+		if (!mkdtemp(dir))
+			throw runtime_error_with_errno("could not create temporary directory");
+		bench_root = dir;
+	}
+
+	const string dirs[] = { "/var", "/var/lib", "/var/lib/pkg" };
+	for (unsigned int i = 0; i < sizeof(dirs) / sizeof(dirs[0]); ++i)
+		if (mkdir((bench_root + dirs[i]).c_str(), 0755) == -1 && errno != EEXIST)
+			throw runtime_error_with_errno("could not create " + bench_root + dirs[i]);
+
+	archive = bench_root + "/" + BENCH_ARCHIVE_NAME + "#" + BENCH_VERSION + PKG_EXT;
+
+	try {
+		make_database();
+		make_archive();
+
+		// The first commit creates the database image, the text
+		// database is only read before that
+		measure("db_open_text", DB_OPEN);
+		measure("db_commit", DB_COMMIT);
+		measure("db_open_image", DB_OPEN);
+		measure("db_find_conflicts", DB_FIND_CONFLICTS);
+		measure("db_rm_pkg", DB_RM_PKG);
+		measure("pkg_open", PKG_OPEN);
+		measure("pkg_install", PKG_INSTALL);
+		measure("pkg_footprint", PKG_FOOTPRINT);
+		measure("pkginfo_owner_exact", OWNER_EXACT);
+		measure("pkginfo_owner_prefix", OWNER_PREFIX);
+		measure("pkginfo_owner_regex", OWNER_REGEX);
+	} catch (...) {
+		if (temporary)
+			nftw(bench_root.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+		throw;
+	}
+
+	if (temporary)
+		nftw(bench_root.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+void pkgbench::print_help() const
+{
+	cout << "usage: " << utilname << " [options]" << endl
+	     << "options:" << endl
+	     << "  -f, --files <number>          files in the database (default 100000)" << endl
+	     << "  -p, --packages <number>       packages in the database (default 1000)" << endl
+	     << "  -a, --archive-files <number>  files in the package archive (default 2000)" << endl
+	     << "  -n, --iterations <number>     runs of each benchmark (default 5)" << endl
+	     << "  -j, --jobs <number>           threads writing files during pkg_install" << endl
+	     << "  -r, --root <path>             scratch root to use instead of a temporary one" << endl
+	     << "  -v, --version                 print version and exit" << endl
+	     << "  -h, --help                    print help and exit" << endl;
+}
+
+string pkgbench::package_name(unsigned int index) const
+{
+	ostringstream name;
+	name << BENCH_PKG_PREFIX << setw(5) << setfill('0') << index;
+	return name.str();
+}
+
+string pkgbench::package_file(unsigned int package, unsigned int file) const
+{
+	ostringstream path;
+	path << "usr/share/bench/" << package_name(package) << "/d" << file / 100 << "/f" << file;
+	return path.str();
+}
+
+void pkgbench::make_database() const
+{
+	const string filename = bench_root + "/" + PKG_DB;
+	ofstream db(filename.c_str());
+	if (!db)
+		throw runtime_error_with_errno("could not create " + filename);
+
+	// Files are spread evenly, every package also lists the
+	// directories leading to them
+	for (unsigned int p = 0; p < npackages; ++p) {
+		const unsigned int count = nfiles / npackages + (p < nfiles % npackages);
+		set<string> files;
+		files.insert("usr/");
+		files.insert("usr/share/");
+		files.insert("usr/share/bench/");
+		files.insert("usr/share/bench/" + package_name(p) + "/");
+		for (unsigned int f = 0; f < count; ++f) {
+			const string file = package_file(p, f);
+			files.insert(file.substr(0, file.rfind('/') + 1));
+			files.insert(file);
+		}
+
+		db << package_name(p) << '\n' << BENCH_VERSION << '\n';
+		copy(files.begin(), files.end(), ostream_iterator<string>(db, "\n"));
+		db << '\n';
+	}
+
+	if (!db.flush())
+		throw runtime_error("could not write " + filename);
+}
+
+void pkgbench::make_archive() const
+{
+	struct archive* a = archive_write_new();
+	archive_write_set_compression_gzip(a);
+	archive_write_set_format_pax_restricted(a);
+	if (archive_write_open_filename(a, archive.c_str()) != ARCHIVE_OK)
+		throw runtime_error_with_errno("could not create " + archive, archive_errno(a));
+
+	// Own files first, then one in ten files of the archive shadows a
+	// file of an installed package so that conflicts are found
+	vector<string> paths;
+	paths.push_back("usr/");
+	paths.push_back("usr/share/");
+	paths.push_back("usr/share/bench/");
+	paths.push_back(string("usr/share/bench/") + BENCH_ARCHIVE_NAME + "/");
+	for (unsigned int f = 0; f < narchive_files - narchive_files / 10; ++f) {
+		ostringstream path;
+		path << "usr/share/bench/" << BENCH_ARCHIVE_NAME << "/d" << f / 100 << "/f" << f;
+		if (f % 100 == 0)
+			paths.push_back(path.str().substr(0, path.str().rfind('/') + 1));
+		paths.push_back(path.str());
+	}
+	for (unsigned int f = 0; f < narchive_files / 10; ++f)
+		paths.push_back(package_file(f % npackages, f / npackages));
+
+	const string data(BENCH_FILE_SIZE, 'x');
+	const time_t mtime = time(0);
+	for (vector<string>::const_iterator i = paths.begin(); i != paths.end(); ++i) {
+		const bool dir = (*i)[i->length() - 1] == '/';
+		struct archive_entry* entry = archive_entry_new();
+		archive_entry_set_pathname(entry, i->c_str());
+		archive_entry_set_mode(entry, dir ? S_IFDIR | 0755 : S_IFREG | 0644);
+		archive_entry_set_size(entry, dir ? 0 : data.size());
+		archive_entry_set_mtime(entry, mtime, 0);
+		archive_entry_set_uname(entry, "root");
+		archive_entry_set_gname(entry, "root");
+
+		if (archive_write_header(a, entry) != ARCHIVE_OK ||
+		    (!dir && archive_write_data(a, data.data(), data.size()) != (ssize_t)data.size())) {
+			archive_entry_free(entry);
+			throw runtime_error("could not write " + archive + ": " + archive_error_string(a));
+		}
+		archive_entry_free(entry);
+	}
+
+	archive_write_finish(a);
+}
+
+void pkgbench::measure(const string& name, benchmark_t benchmark)
+{
+	// Each benchmark gets a process of its own, for a clean
+	// database state and a peak resident set size of its own
+	cout.flush();
+	pid_t pid = fork();
+	if (pid == -1)
+		throw runtime_error_with_errno("fork() failed");
+
+	if (pid == 0) {
+		try {
+			unsigned long long total = run_benchmark(benchmark);
+
+			struct rusage usage;
+			getrusage(RUSAGE_SELF, &usage);
+
+			cout << "{\"benchmark\": \"" << name << "\", "
+			     << "\"files\": " << nfiles << ", "
+			     << "\"packages\": " << npackages << ", "
+			     << "\"archive_files\": " << narchive_files << ", "
+			     << "\"iterations\": " << iterations << ", "
+			     << "\"ns_per_op\": " << total / iterations << ", "
+			     << "\"max_rss_kb\": " << usage.ru_maxrss << "}" << endl;
+		} catch (runtime_error& e) {
+			cerr << utilname << ": " << name << ": " << e.what() << endl;
+			_exit(EXIT_FAILURE);
+		}
+		_exit(EXIT_SUCCESS);
+	}
+
+	int status;
+	if (waitpid(pid, &status, 0) == -1)
+		throw runtime_error_with_errno("waitpid() failed");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+		throw runtime_error("benchmark " + name + " failed");
+}
+
+unsigned long long pkgbench::run_benchmark(benchmark_t benchmark)
+{
+	const set<string> none;
+	pkgutil::file_sums_t sums;
+	unsigned long long total = 0;
+	ofstream null("/dev/null");
+
+	for (unsigned int i = 0; i < iterations; ++i) {
+		pkgbench db;
+		db.jobs = jobs;
+		db.root = trim_filename(bench_root + "/");
+
+		vector<pair<string, string> > owners;
+		string pattern;
+		unsigned long long start = 0;
+
+		switch (benchmark) {
+		case DB_OPEN:
+			start = now();
+			db.db_open(bench_root);
+			break;
+		case DB_COMMIT: {
+			// Rewrite one package, as an upgrade would
+			const string name = package_name(i % npackages);
+			db.db_open(bench_root);
+			db.db_load_files(name);
+			pkginfo_t info = db.packages[name];
+			db.db_add_pkg(name, info);
+			start = now();
+			db.db_commit();
+			break;
+		}
+		case DB_FIND_CONFLICTS: {
+			db.db_open(bench_root);
+			pair<string, pkginfo_t> package = db.pkg_open(archive);
+			start = now();
+			db.db_find_conflicts(package.first, package.second);
+			break;
+		}
+		case DB_RM_PKG:
+			db.db_open(bench_root);
+			start = now();
+			db.db_rm_pkg(package_name(i % npackages));
+			break;
+		case PKG_OPEN:
+			start = now();
+			db.pkg_open(archive);
+			break;
+		case PKG_INSTALL:
+			start = now();
+			db.pkg_install(archive, none, none, pkgutil::file_sums_t(), sums);
+			break;
+		case PKG_FOOTPRINT: {
+			string filename = archive;
+			streambuf* out = cout.rdbuf(null.rdbuf());
+			start = now();
+			try {
+				db.pkg_footprint(filename);
+			} catch (...) {
+				cout.rdbuf(out);
+				throw;
+			}
+			total += now() - start;
+			cout.rdbuf(out);
+			continue;
+		}
+		case OWNER_EXACT:
+		case OWNER_PREFIX:
+		case OWNER_REGEX:
+			if (benchmark == OWNER_EXACT)
+				pattern = "^/" + package_file(npackages / 2, 0) + "$";
+			else if (benchmark == OWNER_PREFIX)
+				pattern = "^/usr/share/bench/" + package_name(npackages / 2) + "/";
+			else
+				pattern = "d1/f1[0-9]7$";
+			db.db_open(bench_root);
+			start = now();
+			db.db_find_owners(pattern, owners);
+			break;
+		}
+
+		total += now() - start;
+	}
+
+	return total;
+}
+
+int main(int argc, char** argv)
+{
+	try {
+		pkgbench bench;
+
+		for (int i = 1; i < argc; i++) {
+			string option(argv[i]);
+			if (option == "-v" || option == "--version") {
+				bench.print_version();
+				return EXIT_SUCCESS;
+			} else if (option == "-h" || option == "--help") {
+				bench.print_help();
+				return EXIT_SUCCESS;
+			}
+		}
+
+		bench.run(argc, argv);
+	} catch (runtime_error& e) {
+		cerr << "pkgbench: " << e.what() << endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,74 @@
+//
+//  pkgutils
+// 
+//  Copyright (c) 2000-2005 Per Liden
+//  Copyright (c) 2006-2007 by CRUX team (http://crux.nu)
+// 
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+//
+
+#ifndef PKGBENCH_H
+#define PKGBENCH_H
+
+#include "pkgutil.h"
+
+#define BENCH_PKG_PREFIX        "bench-"
+#define BENCH_ARCHIVE_NAME      "bench-archive"
+#define BENCH_VERSION           "1.0-1"
+#define BENCH_FILE_SIZE         4096
+
+//
+// Benchmarks of the database and package operations against synthetic
+// databases and packages in a scratch root. Every benchmark runs in its
+// own process, starting from the database on disk, and reports one line
+// of JSON with the time per operation and the peak resident set size.
+//
+class pkgbench : public pkgutil {
+public:
+	pkgbench();
+	virtual void run(int argc, char** argv);
+	virtual void print_help() const;
+
+private:
+	enum benchmark_t {
+		DB_OPEN,
+		DB_COMMIT,
+		DB_FIND_CONFLICTS,
+		DB_RM_PKG,
+		PKG_OPEN,
+		PKG_INSTALL,
+		PKG_FOOTPRINT,
+		OWNER_EXACT,
+		OWNER_PREFIX,
+		OWNER_REGEX
+	};
+
+	void make_database() const;
+	void make_archive() const;
+	void measure(const string& name, benchmark_t benchmark);
+	unsigned long long run_benchmark(benchmark_t benchmark);
+	string package_name(unsigned int index) const;
+	string package_file(unsigned int package, unsigned int file) const;
+
+	string bench_root;
+	string archive;
+	unsigned int nfiles;
+	unsigned int npackages;
+	unsigned int narchive_files;
+	unsigned int iterations;
+};
+
+#endif /* PKGBENCH_H */
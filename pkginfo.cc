@@ -24,8 +24,12 @@
 #include <iterator>
 #include <vector>
 #include <iomanip>
+#include <cstdlib>
 #include <sys/types.h>
-#include <regex.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 void pkginfo::run(int argc, char** argv)
 {
@@ -33,11 +37,16 @@ void pkginfo::run(int argc, char** argv)
 	// Check command line options
 	//
 	int o_footprint_mode = 0;
+	int o_manifest_mode = 0;
+	int o_delta_mode = 0;
 	int o_installed_mode = 0;
 	int o_list_mode = 0;
 	int o_owner_mode = 0;
+	int o_verify_mode = 0;
+	bool o_quick = false;
 	string o_root;
 	string o_arg;
+	string o_base;
 
 	for (int i = 1; i < argc; ++i) {
 		string option(argv[i]);
@@ -57,20 +66,40 @@ void pkginfo::run(int argc, char** argv)
 			o_owner_mode += 1;
 			o_arg = argv[i + 1];
 			i++;
+		} else if (option == "-V" || option == "--verify") {
+			o_verify_mode += 1;
+			if (i + 1 < argc && argv[i + 1][0] != '-') {
+				o_arg = argv[i + 1];
+				i++;
+			}
+		} else if (option == "-q" || option == "--quick") {
+			o_quick = true;
 		} else if (option == "-f" || option == "--footprint") {
 			assert_argument(argv, argc, i);
 			o_footprint_mode += 1;
 			o_arg = argv[i + 1];
 			i++;
+		} else if (option == "-m" || option == "--manifest") {
+			assert_argument(argv, argc, i);
+			o_manifest_mode += 1;
+			o_arg = argv[i + 1];
+			i++;
+		} else if (option == "-D" || option == "--delta") {
+			if (argc - 1 < i + 2)
+				throw runtime_error("option " + option + " requires two arguments");
+			o_delta_mode += 1;
+			o_base = argv[i + 1];
+			o_arg = argv[i + 2];
+			i += 2;
 		} else {
 			throw runtime_error("invalid option " + option);
 		}
 	}
 
-	if (o_footprint_mode + o_installed_mode + o_list_mode + o_owner_mode == 0)
+	if (o_footprint_mode + o_manifest_mode + o_delta_mode + o_installed_mode + o_list_mode + o_owner_mode + o_verify_mode == 0)
 		throw runtime_error("option missing");
 
-	if (o_footprint_mode + o_installed_mode + o_list_mode + o_owner_mode > 1)
+	if (o_footprint_mode + o_manifest_mode + o_delta_mode + o_installed_mode + o_list_mode + o_owner_mode + o_verify_mode > 1)
 		throw runtime_error("too many options");
 
 	if (o_footprint_mode) {
@@ -78,69 +107,186 @@ void pkginfo::run(int argc, char** argv)
 		// Make footprint
 		//
 		pkg_footprint(o_arg);
+	} else if (o_manifest_mode) {
+		//
+		// Make manifest
+		//
+		pkg_manifest(o_arg);
+	} else if (o_delta_mode) {
+		//
+		// Make delta package
+		//
+		pkg_delta(o_base, o_arg);
 	} else {
 		//
-		// Modes that require the database to be opened
+		// Queries pkgutild can answer from the database it keeps open
+		//
+		query_t query = QUERY_UNANSWERED;
+		if (o_installed_mode)
+			query = query_daemon(o_root, "installed", "");
+		else if (o_list_mode)
+			query = query_daemon(o_root, "list", o_arg);
+		else if (o_owner_mode)
+			query = query_daemon(o_root, "owner", o_arg);
+
+		if (query == QUERY_ANSWERED)
+			return;
+
+		//
+		// Modes that require the database to be opened, read as last
+		// committed without waiting for pkgadd or pkgrm to finish
 		//
-		{
-			db_lock lock(o_root, false);
+		if (query == QUERY_UNANSWERED)
 			db_open(o_root);
-		}
 
 		if (o_installed_mode) {
 			//
 			// List installed packages
 			//
-			for (packages_t::const_iterator i = packages.begin(); i != packages.end(); ++i)
-				cout << i->first << ' ' << i->second.version << endl;
+			list_installed(cout);
 		} else if (o_list_mode) {
 			//
 			// List package or file contents
 			//
-			if (db_find_pkg(o_arg)) {
-				copy(packages[o_arg].files.begin(), packages[o_arg].files.end(), ostream_iterator<string>(cout, "\n"));
+			if (query == QUERY_UNANSWERED && db_find_pkg(o_arg)) {
+				list_files(o_arg, cout);
 			} else if (file_exists(o_arg)) {
 				pair<string, pkginfo_t> package = pkg_open(o_arg);
 				copy(package.second.files.begin(), package.second.files.end(), ostream_iterator<string>(cout, "\n"));
 			} else {
 				throw runtime_error(o_arg + " is neither an installed package nor a package file");
 			}
+		} else if (o_verify_mode) {
+			//
+			// Check installed files against the sums recorded by pkgadd
+			//
+			set<string> names;
+			if (o_arg.empty()) {
+				for (packages_t::const_iterator i = packages.begin(); i != packages.end(); ++i)
+					names.insert(i->first);
+			} else if (db_find_pkg(o_arg)) {
+				names.insert(o_arg);
+			} else {
+				throw runtime_error("package " + o_arg + " not installed");
+			}
+
+			map<pair<string, string>, string> problems;
+			set<string> unrecorded;
+			db_verify(names, o_quick, problems, unrecorded);
+
+			if (!o_arg.empty() && !unrecorded.empty())
+				throw runtime_error("no sums recorded for package " + o_arg);
+
+			unsigned int width = 0;
+			for (map<pair<string, string>, string>::const_iterator i = problems.begin(); i != problems.end(); ++i)
+				if (i->first.first.length() > width)
+					width = i->first.first.length();
+
+			for (map<pair<string, string>, string>::const_iterator i = problems.begin(); i != problems.end(); ++i)
+				cout << left << setw(width + 2) << i->first.first << setw(12) << i->second << i->first.second << endl;
+
+			if (!problems.empty())
+				throw runtime_error(itos(problems.size()) + " file(s) failed verification");
 		} else {
 			//
 			// List owner(s) of file or directory
 			//
-			regex_t preg;
-			if (regcomp(&preg, o_arg.c_str(), REG_EXTENDED | REG_NOSUB))
-				throw runtime_error("error compiling regular expression '" + o_arg + "', aborting");
-
-			vector<pair<string, string> > result;
-			result.push_back(pair<string, string>("Package", "File"));
-			unsigned int width = result.begin()->first.length(); // Width of "Package"
-			
-			for (packages_t::const_iterator i = packages.begin(); i != packages.end(); ++i) {
-				for (set<string>::const_iterator j = i->second.files.begin(); j != i->second.files.end(); ++j) {
-					const string file('/' + *j);
-					if (!regexec(&preg, file.c_str(), 0, 0, 0)) {
-						result.push_back(pair<string, string>(i->first, *j));
-						if (i->first.length() > width)
-							width = i->first.length();
-					}
-				}
-			}
-			
-			regfree(&preg);
-			
-			if (result.size() > 1) {
-				for (vector<pair<string, string> >::const_iterator i = result.begin(); i != result.end(); ++i) {
-					cout << left << setw(width + 2) << i->first << i->second << endl;
-				}
-			} else {
+			if (query == QUERY_NOT_FOUND || !list_owners(o_arg, cout))
 				cout << utilname << ": no owner(s) found" << endl;
-			}
 		}
 	}
 }
 
+void pkginfo::list_installed(ostream& out) const
+{
+	for (packages_t::const_iterator i = packages.begin(); i != packages.end(); ++i)
+		out << i->first << ' ' << i->second.version << endl;
+}
+
+void pkginfo::list_files(const string& name, ostream& out)
+{
+	db_load_files(name);
+	copy(packages[name].files.begin(), packages[name].files.end(), ostream_iterator<string>(out, "\n"));
+}
+
+bool pkginfo::list_owners(const string& pattern, ostream& out)
+{
+	vector<pair<string, string> > result;
+	result.push_back(pair<string, string>("Package", "File"));
+	db_find_owners(pattern, result);
+
+	if (result.size() == 1)
+		return false;
+
+	unsigned int width = 0;
+	for (vector<pair<string, string> >::const_iterator i = result.begin(); i != result.end(); ++i)
+		if (i->first.length() > width)
+			width = i->first.length();
+
+	for (vector<pair<string, string> >::const_iterator i = result.begin(); i != result.end(); ++i)
+		out << left << setw(width + 2) << i->first << i->second << endl;
+
+	return true;
+}
+
+pkginfo::query_t pkginfo::query_daemon(const string& path, const string& command, const string& arg) const
+{
+	pkg_stats::phase phase("query_daemon");
+
+	// Anything short of a complete answer leaves the query to us
+	const string socket_name = trim_filename(path + "/") + PKG_DAEMON_SOCKET;
+	struct sockaddr_un address;
+	if (socket_name.length() >= sizeof(address.sun_path))
+		return QUERY_UNANSWERED;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_name.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return QUERY_UNANSWERED;
+
+	struct timeval timeout = { DAEMON_TIMEOUT, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	string request = command + '\0' + arg + '\0';
+	string response;
+	if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0 &&
+	    send(fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size() &&
+	    shutdown(fd, SHUT_WR) == 0) {
+		char buf[65536];
+		ssize_t length;
+		while ((length = read(fd, buf, sizeof(buf))) > 0)
+			response.append(buf, length);
+		if (length == -1)
+			response.clear();
+	}
+	close(fd);
+
+	string::size_type end = response.find('\n');
+	if (end == string::npos)
+		return QUERY_UNANSWERED;
+
+	const string status(response, 0, end);
+	if (status.compare(0, 3, "ok ") == 0) {
+		const char* digits = status.c_str() + 3;
+		char* digits_end = 0;
+		const unsigned long length = strtoul(digits, &digits_end, 10);
+		if (digits_end == digits || *digits_end != '\0' || length != response.size() - end - 1)
+			return QUERY_UNANSWERED;
+		cout.write(response.data() + end + 1, response.size() - end - 1);
+		return QUERY_ANSWERED;
+	} else if (status == "missing") {
+		return QUERY_NOT_FOUND;
+	} else if (status == "error") {
+		throw runtime_error(response.substr(end + 1));
+	}
+
+	return QUERY_UNANSWERED;
+}
+
 void pkginfo::print_help() const
 {
 	cout << "usage: " << utilname << " [options]" << endl
@@ -149,7 +295,12 @@ void pkginfo::print_help() const
 	     << "  -l, --list <package|file>   list files in <package> or <file>" << endl
 	     << "  -o, --owner <pattern>       list owner(s) of file(s) matching <pattern>" << endl
 	     << "  -f, --footprint <file>      print footprint for <file>" << endl
+	     << "  -m, --manifest <file>       print manifest for <file>" << endl
+	     << "  -D, --delta <old> <file>    write delta package from <old> to <file>" << endl
+	     << "  -V, --verify [<package>]    check installed files of all packages or <package>" << endl
+	     << "  -q, --quick                 with --verify, trust files of unchanged size and time" << endl
 	     << "  -r, --root <path>           specify alternative installation root" << endl
+	     << "  --stats[=json]              print time per phase and counters when done" << endl
 	     << "  -v, --version               print version and exit" << endl
 	     << "  -h, --help                  print help and exit" << endl;
 }
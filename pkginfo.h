@@ -30,6 +30,20 @@ public:
 	pkginfo() : pkgutil("pkginfo") {}
 	virtual void run(int argc, char** argv);
 	virtual void print_help() const;
+
+protected:
+	// Outcome of asking pkgutild(8)
+	enum query_t {
+		QUERY_UNANSWERED,
+		QUERY_ANSWERED,
+		QUERY_NOT_FOUND
+	};
+
+	explicit pkginfo(const string& name) : pkgutil(name) {}
+	void list_installed(ostream& out) const;
+	void list_files(const string& name, ostream& out);
+	bool list_owners(const string& pattern, ostream& out);
+	query_t query_daemon(const string& path, const string& command, const string& arg) const;
 };
 
 #endif /* PKGINFO_H */
@@ -21,15 +21,20 @@
 //
 
 #include "pkgrm.h"
+#include <cstdlib>
 #include <unistd.h>
+#include <fnmatch.h>
+#include <regex.h>
 
 void pkgrm::run(int argc, char** argv)
 {
 	//
 	// Check command line options
 	//
-	string o_package;
+	vector<string> o_packages;
 	string o_root;
+	bool o_regex = false;
+	unsigned int o_wait = 0;
 
 	for (int i = 1; i < argc; i++) {
 		string option(argv[i]);
@@ -37,14 +42,34 @@ void pkgrm::run(int argc, char** argv)
 			assert_argument(argv, argc, i);
 			o_root = argv[i + 1];
 			i++;
-		} else if (option[0] == '-' || !o_package.empty()) {
+		} else if (option == "-E" || option == "--regex") {
+			o_regex = true;
+		} else if (option == "-j" || option == "--jobs") {
+			assert_argument(argv, argc, i);
+			char* end;
+			long n = strtol(argv[i + 1], &end, 10);
+			if (*end || n < 1 || n > MAX_JOBS)
+				throw runtime_error("invalid number of jobs " + string(argv[i + 1]));
+			jobs = n;
+			i++;
+		} else if (option == "-d" || option == "--defer-ldconfig") {
+			defer_ldconfig = true;
+		} else if (option == "-w" || option == "--wait") {
+			assert_argument(argv, argc, i);
+			char* end;
+			long n = strtol(argv[i + 1], &end, 10);
+			if (*end || n < 0)
+				throw runtime_error("invalid number of seconds " + string(argv[i + 1]));
+			o_wait = n;
+			i++;
+		} else if (option[0] == '-') {
 			throw runtime_error("invalid option " + option);
 		} else {
-			o_package = option;
+			o_packages.push_back(option);
 		}
 	}
 
-	if (o_package.empty())
+	if (o_packages.empty())
 		throw runtime_error("option missing");
 
 	//
@@ -54,26 +79,71 @@ void pkgrm::run(int argc, char** argv)
 		throw runtime_error("only root can remove packages");
 
 	//
-	// Remove package
+	// Remove packages
 	//
 	{
-		db_lock lock(o_root, true);
+		db_lock lock(o_root, true, o_wait);
 		db_open(o_root);
 
-		if (!db_find_pkg(o_package))
-			throw runtime_error("package " + o_package + " not installed");
+		set<string> names;
+		for (vector<string>::const_iterator i = o_packages.begin(); i != o_packages.end(); ++i)
+			if (!select_packages(*i, o_regex, names))
+				throw runtime_error("package " + *i + " not installed");
 
-		db_rm_pkg(o_package);
+		db_rm_pkgs(names);
 		ldconfig();
 		db_commit();
+
+		// The packages are removed at this point, leftover sums are
+		// only read again for a package of the same name and version
+		for (set<string>::const_iterator i = names.begin(); i != names.end(); ++i) {
+			try {
+				db_rm_sums(*i);
+			} catch (runtime_error& e) {
+				cerr << utilname << ": " << e.what() << endl;
+			}
+		}
+	}
+}
+
+bool pkgrm::select_packages(const string& pattern, bool regex, set<string>& names)
+{
+	// Plain names are looked up directly
+	if (!regex && pattern.find_first_of("*?[") == string::npos) {
+		if (!db_find_pkg(pattern))
+			return false;
+		names.insert(pattern);
+		return true;
+	}
+
+	regex_t preg;
+	if (regex && regcomp(&preg, ("^(" + pattern + ")$").c_str(), REG_EXTENDED | REG_NOSUB))
+		throw runtime_error("error compiling regular expression '" + pattern + "', aborting");
+
+	bool found = false;
+	for (packages_t::const_iterator i = packages.begin(); i != packages.end(); ++i) {
+		if (regex ? !regexec(&preg, i->first.c_str(), 0, 0, 0) : !fnmatch(pattern.c_str(), i->first.c_str(), 0)) {
+			names.insert(i->first);
+			found = true;
+		}
 	}
+
+	if (regex)
+		regfree(&preg);
+
+	return found;
 }
 
 void pkgrm::print_help() const
 {
-	cout << "usage: " << utilname << " [options] <package>" << endl
+	cout << "usage: " << utilname << " [options] <package> ..." << endl
 	     << "options:" << endl
-	     << "  -r, --root <path>   specify alternative installation root" << endl
-	     << "  -v, --version       print version and exit" << endl
-	     << "  -h, --help          print help and exit" << endl;
+	     << "  -E, --regex           match <package> as regular expression instead of a pattern" << endl
+	     << "  -j, --jobs <number>   number of threads removing files (default: number of CPUs)" << endl
+	     << "  -d, --defer-ldconfig  leave running ldconfig to a later pkgadd or pkgrm" << endl
+	     << "  -w, --wait <seconds>  wait for the database lock held by another process" << endl
+	     << "  -r, --root <path>     specify alternative installation root" << endl
+	     << "  --stats[=json]        print time per phase and counters when done" << endl
+	     << "  -v, --version         print version and exit" << endl
+	     << "  -h, --help            print help and exit" << endl;
 }
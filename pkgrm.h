@@ -30,6 +30,9 @@ public:
 	pkgrm() : pkgutil("pkgrm") {}
 	virtual void run(int argc, char** argv);
 	virtual void print_help() const;
+
+private:
+	bool select_packages(const string& pattern, bool regex, set<string>& names);
 };
 
 #endif /* PKGRM_H */
@@ -23,12 +23,15 @@
 #include "pkgutil.h"
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <iterator>
 #include <algorithm>
+#include <vector>
 #include <cstdio>
 #include <cstring>
 #include <cerrno>
 #include <csignal>
+#include <cctype>
 #include <ext/stdio_filebuf.h>
 #include <pwd.h>
 #include <grp.h>
@@ -37,21 +40,176 @@
 #include <sys/wait.h>
 #include <sys/file.h>
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <glob.h>
+#include <regex.h>
 #include <archive.h>
 #include <archive_entry.h>
+#include <zlib.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// Missing headers, or headers from before IORING_OP_UNLINKAT (Linux
+// 5.11), leave io_ring without a kernel ring, every caller then takes
+// the system call path
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_NATIVE_WORKERS)
+#define HAVE_IO_URING
+#endif
+
+#define DB_IMAGE_MAGIC      "pkgdb03"
+#define JOURNAL_MAGIC       "pkgjnl3"
+#define DB_OPEN_ATTEMPTS    5
+
+// Journals are compacted into the database once they are larger than
+// this and than half of the database
+#define JOURNAL_SIZE_MIN    (256 * 1024)
+#define DB_IMAGE_BYTE_ORDER 0x01020304
+
+#define MANIFEST_MAGIC      "pkgutils-manifest"
+#define MANIFEST_VERSION    1
+
+#define DELTA_MAGIC         "pkgutils-delta"
+#define DELTA_VERSION       1
+#define DELTA_INDEX         ".DELTA"
 
+// Largest regular file buffered in memory for a worker thread
+#define INSTALL_BUFFER_MAX  (1024 * 1024)
+
+// Largest inflated member of a chunked gzip package, and the number of
+// members inflated per thread at a time
+#define CHUNK_SIZE_MAX      65536
+#define CHUNKS_PER_THREAD   8
+
+// Compressions libarchive may not know itself are left to the programs
 #define INIT_ARCHIVE(ar) \
 	archive_read_support_compression_all((ar)); \
+	archive_read_support_compression_program_signature((ar), XZ_DECOMPRESS, xz_magic, sizeof(xz_magic)); \
+	archive_read_support_compression_program_signature((ar), ZSTD_DECOMPRESS, zstd_magic, sizeof(zstd_magic)); \
 	archive_read_support_format_all((ar))
 
+static const char xz_magic[] = { '\xfd', '7', 'z', 'X', 'Z', '\0' };
+static const char zstd_magic[] = { '\x28', '\xb5', '\x2f', '\xfd' };
+
+// Package extensions, by compression
+static const char* const pkg_extensions[] = { PKG_EXT, PKG_EXT_XZ, PKG_EXT_ZST };
+
 using __gnu_cxx::stdio_filebuf;
 
+// System calls counted for --stats
+static int lstat_counted(const char* filename, struct stat* buf)
+{
+	pkg_stats::add(pkg_stats::LSTAT_CALLS);
+	return lstat(filename, buf);
+}
+
+static int fsync_counted(int fd)
+{
+	pkg_stats::phase phase("fsync");
+	pkg_stats::add(pkg_stats::FSYNC_CALLS);
+	return fsync(fd);
+}
+
+// Bytes inflated from a package file, staged copies are plain tar
+static void count_inflated(struct archive* archive, const string& filename)
+{
+	for (size_t n = 0; n < sizeof(pkg_extensions) / sizeof(pkg_extensions[0]); ++n) {
+		const size_t length = strlen(pkg_extensions[n]);
+		if (filename.length() >= length && !filename.compare(filename.length() - length, length, pkg_extensions[n])) {
+			pkg_stats::add(pkg_stats::BYTES_INFLATED, archive_position_uncompressed(archive));
+			return;
+		}
+	}
+}
+
+//
+// Finishes an archive handle when it goes out of scope, so that handles
+// are not leaked when reading or writing a package throws.
+//
+class archive_guard {
+public:
+	archive_guard(struct archive* archive, int (*finisher)(struct archive*))
+		: archive(archive), finisher(finisher) {}
+	~archive_guard() { finish(); }
+	void reset(struct archive* other) { finish(); archive = other; }
+	void finish()
+	{
+		if (archive)
+			finisher(archive);
+		archive = 0;
+	}
+private:
+	archive_guard(const archive_guard&);
+	archive_guard& operator=(const archive_guard&);
+
+	struct archive* archive;
+	int (*finisher)(struct archive*);
+};
+
+struct journal_header_t {
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t generation;
+};
+
+struct journal_record_t {
+	uint32_t length;
+	uint32_t crc;
+};
+
+static bool path_ptr_less(const char* a, const char* b)
+{
+	return strcmp(a, b) < 0;
+}
+
+static bool path_ptr_equal(const char* a, const char* b)
+{
+	return strcmp(a, b) == 0;
+}
+
+static bool path_id_less(path_pool::id_t id, const char* path)
+{
+	return strcmp(file_list::pool.str(id), path) < 0;
+}
+
+static bool path_id_order(path_pool::id_t a, path_pool::id_t b)
+{
+	return a != b && strcmp(file_list::pool.str(a), file_list::pool.str(b)) < 0;
+}
+
+static void read_entry(struct archive_entry* entry, pkgutil::entry_t& e)
+{
+	const char* symlink = archive_entry_symlink(entry);
+	const char* hardlink = archive_entry_hardlink(entry);
+
+	e.path = archive_entry_pathname(entry);
+	e.mode = archive_entry_mode(entry);
+	e.uid = archive_entry_uid(entry);
+	e.gid = archive_entry_gid(entry);
+	e.size = archive_entry_size(entry);
+	e.mtime = archive_entry_mtime(entry);
+	e.rdevmajor = archive_entry_rdevmajor(entry);
+	e.rdevminor = archive_entry_rdevminor(entry);
+	e.symlink = symlink ? symlink : "";
+	e.hardlink = hardlink ? hardlink : "";
+}
+
 pkgutil::pkgutil(const string& name)
-	: utilname(name)
+	: utilname(name), jobs(1), defer_ldconfig(false), ldconfig_triggered(false), library_dirs_read(false), journaled(false), journal_size(0), generation(0)
 {
+	// One writer thread per online processor
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 1)
+		jobs = cpus < MAX_JOBS ? cpus : MAX_JOBS;
+
 	// Ignore signals
 	struct sigaction sa;
 	memset(&sa, 0, sizeof(sa));
@@ -64,36 +222,110 @@ pkgutil::pkgutil(const string& name)
 
 void pkgutil::db_open(const string& path)
 {
-	// Read database
+	pkg_stats::phase phase("db_open");
+
 	root = trim_filename(path + "/");
 	const string filename = root + PKG_DB;
 
+	// Readers do not take the lock. A commit moves the new database into
+	// place after its journal record, and compaction before it removes
+	// the journal and replaces the image, so a database still found at
+	// its path once everything has been read was read together with the
+	// journal and image belonging to it
+	for (unsigned int attempt = 1; ; ++attempt) {
+		struct stat db_stat;
+		db_read(filename, db_stat);
+
+		struct stat current;
+		if (attempt == DB_OPEN_ATTEMPTS ||
+		    (stat(filename.c_str(), &current) == 0 && current.st_ino == db_stat.st_ino &&
+		     current.st_mtim.tv_sec == db_stat.st_mtim.tv_sec && current.st_mtim.tv_nsec == db_stat.st_mtim.tv_nsec))
+			break;
+
+		db_close();
+	}
+}
+
+void pkgutil::db_read(const string& filename, struct stat& db_stat)
+{
 	int fd = open(filename.c_str(), O_RDONLY);
 	if (fd == -1)
 		throw runtime_error_with_errno("could not open " + filename);
 
-	stdio_filebuf<char> filebuf(fd, ios::in, getpagesize());
-	istream in(&filebuf);
-	if (!in)
-		throw runtime_error_with_errno("could not read " + filename);
+	if (fstat(fd, &db_stat) == -1) {
+		int e = errno;
+		close(fd);
+		throw runtime_error_with_errno("could not stat " + filename, e);
+	}
+	db_file_stat = db_stat;
+
+	// Use the binary image and the journal if the text database is one
+	// they describe, file lists are then only materialized when needed
+	if (image.map(root + PKG_DB_BIN)) {
+		generation = image.generation();
+
+		for (uint32_t i = 0; i < image.pkg_count(); ++i) {
+			const db_image::package_t& pkg = image.pkg(i);
+			pkginfo_t info;
+			info.version = image.str(pkg.version);
+			packages.insert(packages.end(), make_pair(string(image.str(pkg.name)), info));
+			unloaded.insert(unloaded.end(), image.str(pkg.name));
+		}
+
+		if (db_replay_journal(db_stat)) {
+			close(fd);
+			journaled = true;
+#ifndef NDEBUG
+			cerr << packages.size() << " packages found in database image and journal" << endl;
+#endif
+			return;
+		}
+
+		image.unmap();
+		packages.clear();
+		unloaded.clear();
+		dirty.clear();
+	}
+
+	// Read the text database, every path goes into the pool
+	string text;
+	text.reserve(db_stat.st_size + 1);
+	vector<char> buf(getpagesize() * 16);
+	for (ssize_t n; (n = read(fd, &buf[0], buf.size())) != 0;) {
+		if (n == -1) {
+			int e = errno;
+			close(fd);
+			throw runtime_error_with_errno("could not read " + filename, e);
+		}
+		text.append(&buf[0], n);
+	}
+	close(fd);
 
-	while (!in.eof()) {
+	replace(text.begin(), text.end(), '\n', '\0');
+	text += '\0';
+
+	const string::size_type end = text.size() - 1;
+	string::size_type pos = 0;
+	while (pos < end) {
 		// Read record
-		string name;
+		const char* name = &text[pos];
+		pos = min(end, pos + strlen(name) + 1);
 		pkginfo_t info;
-		getline(in, name);
-		getline(in, info.version);
-		for (;;) {
-			string file;
-			getline(in, file);
-         
-			if (file.empty())
-				break; // End of record
-         
-			info.files.insert(info.files.end(), file);
+		info.version = &text[pos];
+		pos = min(end, pos + info.version.length() + 1);
+		while (pos < end && text[pos]) {
+			info.files.append(&text[pos]);
+			pos += strlen(&text[pos]) + 1;
+		}
+		pos = min(end, pos + 1); // End of record
+
+		// Later records of a package replace earlier ones
+		if (!info.files.empty()) {
+			info.files.sort();
+			pkginfo_t& pkg = packages[name];
+			pkg.version.swap(info.version);
+			pkg.files.swap(info.files);
 		}
-		if (!info.files.empty())
-			packages[name] = info;
 	}
 
 #ifndef NDEBUG
@@ -101,28 +333,120 @@ void pkgutil::db_open(const string& path)
 #endif
 }
 
+void pkgutil::db_close()
+{
+	packages.clear();
+	image.unmap();
+	unloaded.clear();
+	dirty.clear();
+	pending.clear();
+	journaled = false;
+	journal_size = 0;
+	generation = 0;
+}
+
+void pkgutil::db_list_files(const string& name, const pkginfo_t& info, vector<const char*>& files) const
+{
+	files.clear();
+
+	if (unloaded.find(name) == unloaded.end()) {
+		files.assign(info.files.begin(), info.files.end());
+		return;
+	}
+
+	const db_image::package_t* pkg = image.pkg_find(name);
+	if (!pkg)
+		throw runtime_error("package " + name + " not found in database image");
+
+	const uint32_t* offsets = image.pkg_files(*pkg);
+	files.reserve(pkg->nfiles);
+	for (uint32_t i = 0; i < pkg->nfiles; ++i)
+		files.push_back(image.str(offsets[i]));
+}
+
 void pkgutil::db_commit()
 {
-	const string dbfilename = root + PKG_DB;
-	const string dbfilename_new = dbfilename + ".incomplete_transaction";
-	const string dbfilename_bak = dbfilename + ".backup";
+	pkg_stats::phase phase("db_commit");
+
+	// The text database is rewritten on every commit for the tools that
+	// read it, but only synchronized when the journal is compacted. Until
+	// the journal is large both on its own and compared to the database,
+	// the changed packages are appended to it and synchronized instead
+	if (journaled && (journal_size < JOURNAL_SIZE_MIN || journal_size * 2 <= db_file_stat.st_size)) {
+		const string dbfilename_new = root + PKG_DB + ".incomplete_transaction";
+		struct stat db_stat;
+
+		db_write(dbfilename_new, false, db_stat);
+		db_append_journal(db_stat);
+		db_replace(dbfilename_new);
+		db_file_stat = db_stat;
+		pending.clear();
 
-	// Remove failed transaction (if it exists)
-	if (unlink(dbfilename_new.c_str()) == -1 && errno != ENOENT)
-		throw runtime_error_with_errno("could not remove " + dbfilename_new);
+#ifndef NDEBUG
+		cerr << packages.size() << " packages written to database, journal " << journal_size << " bytes" << endl;
+#endif
+		return;
+	}
+
+	db_compact();
+}
+
+void pkgutil::db_compact()
+{
+	const string dbfilename_new = root + PKG_DB + ".incomplete_transaction";
+	const string journal_filename = root + PKG_DB_JOURNAL;
 
 	// Write new database
-	int fd_new = creat(dbfilename_new.c_str(), 0444);
+	struct stat db_stat;
+	db_write(dbfilename_new, true, db_stat);
+	db_replace(dbfilename_new);
+	db_file_stat = db_stat;
+
+	// The text database is committed at this point. The old journal
+	// goes before the new image is written, so that the two are never
+	// combined, and a missing or stale image only means that the next
+	// reader parses the text
+	pending.clear();
+	journaled = false;
+	if (unlink(journal_filename.c_str()) == -1 && errno != ENOENT) {
+		cerr << utilname << ": could not remove " << journal_filename << ": " << strerror(errno) << endl;
+		return;
+	}
+
+	try {
+		++generation;
+		db_commit_image(db_stat);
+		journal_size = 0;
+		journaled = true;
+	} catch (runtime_error& e) {
+		cerr << utilname << ": " << e.what() << endl;
+	}
+
+#ifndef NDEBUG
+	cerr << packages.size() << " packages written to database" << endl;
+#endif
+}
+
+void pkgutil::db_write(const string& filename, bool sync, struct stat& db_stat) const
+{
+	// Remove failed transaction (if it exists)
+	if (unlink(filename.c_str()) == -1 && errno != ENOENT)
+		throw runtime_error_with_errno("could not remove " + filename);
+
+	int fd_new = creat(filename.c_str(), 0444);
 	if (fd_new == -1)
-		throw runtime_error_with_errno("could not create " + dbfilename_new);
+		throw runtime_error_with_errno("could not create " + filename);
 
 	stdio_filebuf<char> filebuf_new(fd_new, ios::out, getpagesize());
 	ostream db_new(&filebuf_new);
+	vector<const char*> files;
 	for (packages_t::const_iterator i = packages.begin(); i != packages.end(); ++i) {
-		if (!i->second.files.empty()) {
+		db_list_files(i->first, i->second, files);
+		if (!files.empty()) {
 			db_new << i->first << "\n";
 			db_new << i->second.version << "\n";
-			copy(i->second.files.begin(), i->second.files.end(), ostream_iterator<string>(db_new, "\n"));
+			for (vector<const char*>::const_iterator j = files.begin(); j != files.end(); ++j)
+				db_new << *j << "\n";
 			db_new << "\n";
 		}
 	}
@@ -131,11 +455,20 @@ void pkgutil::db_commit()
 
 	// Make sure the new database was successfully written
 	if (!db_new)
-		throw runtime_error("could not write " + dbfilename_new);
+		throw runtime_error("could not write " + filename);
 
 	// Synchronize file to disk
-	if (fsync(fd_new) == -1)
-		throw runtime_error_with_errno("could not synchronize " + dbfilename_new);
+	if (sync && fsync_counted(fd_new) == -1)
+		throw runtime_error_with_errno("could not synchronize " + filename);
+
+	if (fstat(fd_new, &db_stat) == -1)
+		throw runtime_error_with_errno("could not stat " + filename);
+}
+
+void pkgutil::db_replace(const string& filename) const
+{
+	const string dbfilename = root + PKG_DB;
+	const string dbfilename_bak = dbfilename + ".backup";
 
 	// Relink database backup
 	if (unlink(dbfilename_bak.c_str()) == -1 && errno != ENOENT)
@@ -144,479 +477,3497 @@ void pkgutil::db_commit()
 		throw runtime_error_with_errno("could not create " + dbfilename_bak);
 
 	// Move new database into place
-	if (rename(dbfilename_new.c_str(), dbfilename.c_str()) == -1)
-		throw runtime_error_with_errno("could not rename " + dbfilename_new + " to " + dbfilename);
+	if (rename(filename.c_str(), dbfilename.c_str()) == -1)
+		throw runtime_error_with_errno("could not rename " + filename + " to " + dbfilename);
+}
 
-#ifndef NDEBUG
-	cerr << packages.size() << " packages written to database" << endl;
-#endif
+//
+// The journal starts with a header naming the generation of the image it
+// applies to, followed by one record per transaction: payload length and
+// CRC-32, then the inode, size and mtime of the text database written by
+// the transaction and every package it changed, in the text database
+// format, with removed packages as a name prefixed by '-'. A record that
+// is cut short or fails its checksum ends the journal. Records are
+// replayed up to the one written with the text database that was opened,
+// so readers that do not take the lock get the state of that database,
+// and a record whose database never replaced the old one is dropped by
+// the next. Returns whether the text database is described by the image
+// and the journal.
+//
+bool pkgutil::db_replay_journal(const struct stat& db_stat)
+{
+	bool matched = image.matches(db_stat);
+	journal_size = 0;
+
+	const string filename = root + PKG_DB_JOURNAL;
+	ifstream in(filename.c_str(), ios::binary);
+	if (!in)
+		return matched;
+
+	const string journal((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+	journal_header_t header;
+	if (journal.size() < sizeof(header))
+		return matched;
+
+	memcpy(&header, journal.data(), sizeof(header));
+	if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) ||
+	    header.byte_order != DB_IMAGE_BYTE_ORDER)
+		return matched;
+
+	if (header.generation > generation)
+		generation = header.generation;
+	if (header.generation != image.generation())
+		return matched;
+
+	journal_size = sizeof(header);
+
+	journal_record_t record;
+	unsigned long long ino = 0, size = 0;
+	long long mtime = 0, mtime_nsec = 0;
+	while (!matched && journal.size() - journal_size >= sizeof(record)) {
+		memcpy(&record, journal.data() + journal_size, sizeof(record));
+		if (journal.size() - journal_size - sizeof(record) < record.length)
+			break;
+
+		const string payload = journal.substr(journal_size + sizeof(record), record.length);
+		if (crc32(0, reinterpret_cast<const Bytef*>(payload.data()), payload.size()) != record.crc)
+			break;
+
+		istringstream data(payload);
+		data >> ino >> size >> mtime >> mtime_nsec;
+		data.ignore(1);
+
+		string name;
+		while (getline(data, name) && !name.empty()) {
+			if (name[0] == '-') {
+				name.erase(0, 1);
+				packages.erase(name);
+			} else {
+				pkginfo_t info;
+				getline(data, info.version);
+				for (string file; getline(data, file) && !file.empty();)
+					info.files.insert(file);
+				packages[name] = info;
+			}
+			unloaded.erase(name);
+			dirty.insert(name);
+		}
+
+		matched = ino == (unsigned long long)db_stat.st_ino &&
+			size == (unsigned long long)db_stat.st_size &&
+			mtime == (long long)db_stat.st_mtim.tv_sec &&
+			mtime_nsec == (long long)db_stat.st_mtim.tv_nsec;
+		journal_size += sizeof(record) + record.length;
+	}
+
+	// The text database written by the last transaction is not
+	// synchronized, a crash can leave it shorter than it was written,
+	// but not changed later than that
+	if (!matched && ino == (unsigned long long)db_stat.st_ino && size > (unsigned long long)db_stat.st_size &&
+	    (db_stat.st_mtim.tv_sec < mtime || (db_stat.st_mtim.tv_sec == mtime && db_stat.st_mtim.tv_nsec <= mtime_nsec)))
+		matched = true;
+
+	return matched;
 }
 
-void pkgutil::db_add_pkg(const string& name, const pkginfo_t& info)
+void pkgutil::db_append_journal(const struct stat& db_stat)
 {
-	packages[name] = info;
+	ostringstream data;
+	data << (unsigned long long)db_stat.st_ino << ' '
+	     << (unsigned long long)db_stat.st_size << ' '
+	     << (long long)db_stat.st_mtim.tv_sec << ' '
+	     << (long long)db_stat.st_mtim.tv_nsec << '\n';
+	for (set<string>::const_iterator i = pending.begin(); i != pending.end(); ++i) {
+		packages_t::const_iterator pkg = packages.find(*i);
+		if (pkg == packages.end() || pkg->second.files.empty()) {
+			data << '-' << *i << '\n';
+		} else {
+			data << *i << '\n' << pkg->second.version << '\n';
+			copy(pkg->second.files.begin(), pkg->second.files.end(), ostream_iterator<string>(data, "\n"));
+			data << '\n';
+		}
+	}
+	data << '\n';
+
+	const string payload = data.str();
+	journal_record_t record;
+	record.length = payload.size();
+	record.crc = crc32(0, reinterpret_cast<const Bytef*>(payload.data()), payload.size());
+
+	const string filename = root + PKG_DB_JOURNAL;
+	int fd = open(filename.c_str(), O_WRONLY | O_CREAT, 0444);
+	if (fd == -1)
+		throw runtime_error_with_errno("could not open " + filename);
+
+	// Drop whatever follows the last replayed transaction, or start
+	// a new journal for the current image
+	string buffer;
+	if (journal_size == 0) {
+		journal_header_t header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+		header.byte_order = DB_IMAGE_BYTE_ORDER;
+		header.generation = generation;
+		buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+	}
+	buffer.append(reinterpret_cast<const char*>(&record), sizeof(record));
+	buffer += payload;
+
+	if (ftruncate(fd, journal_size) == -1 ||
+	    pwrite(fd, buffer.data(), buffer.size(), journal_size) != (ssize_t)buffer.size()) {
+		int e = errno;
+		close(fd);
+		throw runtime_error_with_errno("could not write " + filename, e);
+	}
+
+	if (fsync_counted(fd) == -1) {
+		int e = errno;
+		close(fd);
+		throw runtime_error_with_errno("could not synchronize " + filename, e);
+	}
+
+	close(fd);
+	journal_size += buffer.size();
 }
 
-bool pkgutil::db_find_pkg(const string& name)
+void pkgutil::db_build_image(string& image_data, const struct stat* db_stat) const
 {
-	return (packages.find(name) != packages.end());
+	vector<db_image::record_t> table;
+	table.reserve(packages.size());
+
+	for (packages_t::const_iterator i = packages.begin(); i != packages.end(); ++i) {
+		table.push_back(db_image::record_t());
+		db_image::record_t& record = table.back();
+		record.name = i->first.c_str();
+		record.version = i->second.version.c_str();
+		db_list_files(i->first, i->second, record.files);
+		if (record.files.empty())
+			table.pop_back();
+	}
+
+	db_image::build(table, generation, db_stat, image_data);
 }
 
-void pkgutil::db_rm_pkg(const string& name)
+void db_image::build(const vector<record_t>& packages, uint32_t generation,
+                     const struct stat* db_stat, string& image)
 {
-	set<string> files = packages[name].files;
-	packages.erase(name);
+	// Lay out the string table, names and versions first, then
+	// every distinct path once and in sorted order
+	string strings;
+	vector<db_image::package_t> table;
+	vector<const char*> paths;
+
+	for (vector<record_t>::const_iterator i = packages.begin(); i != packages.end(); ++i) {
+		db_image::package_t pkg;
+		pkg.name = strings.size();
+		strings.append(i->name, strlen(i->name) + 1);
+		pkg.version = strings.size();
+		strings.append(i->version, strlen(i->version) + 1);
+		pkg.nfiles = i->files.size();
+		table.push_back(pkg);
+
+		paths.insert(paths.end(), i->files.begin(), i->files.end());
+	}
 
-#ifndef NDEBUG
-	cerr << "Removing package phase 1 (all files in package):" << endl;
-	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
-	cerr << endl;
-#endif
+	sort(paths.begin(), paths.end(), path_ptr_less);
+	paths.erase(unique(paths.begin(), paths.end(), path_ptr_equal), paths.end());
 
-	// Don't delete files that still have references
-	for (packages_t::const_iterator i = packages.begin(); i != packages.end(); ++i)
-		for (set<string>::const_iterator j = i->second.files.begin(); j != i->second.files.end(); ++j)
-			files.erase(*j);
+	vector<db_image::path_t> index(paths.size());
+	for (vector<const char*>::size_type i = 0; i < paths.size(); ++i) {
+		index[i].path = strings.size();
+		index[i].nowners = 0;
+		strings.append(paths[i], strlen(paths[i]) + 1);
+	}
 
-#ifndef NDEBUG
-	cerr << "Removing package phase 2 (files that still have references excluded):" << endl;
-	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
-	cerr << endl;
-#endif
+	// File table, remembering the path index of every file
+	vector<uint32_t> files;
+	vector<uint32_t> file_paths;
+	vector<db_image::package_t>::iterator pkg = table.begin();
+	for (vector<record_t>::const_iterator i = packages.begin(); i != packages.end(); ++i) {
+		pkg->files = files.size();
+		for (vector<const char*>::const_iterator j = i->files.begin(); j != i->files.end(); ++j) {
+			uint32_t n = lower_bound(paths.begin(), paths.end(), *j, path_ptr_less) - paths.begin();
+			files.push_back(index[n].path);
+			file_paths.push_back(n);
+			index[n].nowners++;
+		}
+		++pkg;
+	}
 
-	// Delete the files
-	for (set<string>::const_reverse_iterator i = files.rbegin(); i != files.rend(); ++i) {
-		const string filename = root + *i;
-		if (file_exists(filename) && remove(filename.c_str()) == -1) {
-			const char* msg = strerror(errno);
-			cerr << utilname << ": could not remove " << filename << ": " << msg << endl;
+	// Owner table, packages are visited in order so every
+	// run of owners ends up sorted by package index
+	uint32_t nowners = 0;
+	for (vector<db_image::path_t>::iterator i = index.begin(); i != index.end(); ++i) {
+		i->owners = nowners;
+		nowners += i->nowners;
+		i->nowners = 0;
+	}
+
+	vector<uint32_t> owners(nowners);
+	vector<uint32_t>::const_iterator file_path = file_paths.begin();
+	for (uint32_t i = 0; i < table.size(); ++i) {
+		for (uint32_t j = 0; j < table[i].nfiles; ++j, ++file_path) {
+			db_image::path_t& path = index[*file_path];
+			owners[path.owners + path.nowners++] = i;
 		}
 	}
+
+	db_image::header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DB_IMAGE_MAGIC, sizeof(header.magic));
+	header.byte_order = DB_IMAGE_BYTE_ORDER;
+	header.npackages = table.size();
+	header.packages = sizeof(header);
+	header.nfiles = files.size();
+	header.files = header.packages + table.size() * sizeof(db_image::package_t);
+	header.npaths = index.size();
+	header.paths = header.files + files.size() * sizeof(uint32_t);
+	header.nowners = owners.size();
+	header.owners = header.paths + index.size() * sizeof(db_image::path_t);
+	header.strings = header.owners + owners.size() * sizeof(uint32_t);
+	header.strings_size = strings.size();
+	header.generation = generation;
+	if (db_stat) {
+		header.db_ino = db_stat->st_ino;
+		header.db_size = db_stat->st_size;
+		header.db_mtime = db_stat->st_mtim.tv_sec;
+		header.db_mtime_nsec = db_stat->st_mtim.tv_nsec;
+	}
+
+	image.clear();
+	image.reserve(header.strings + strings.size());
+	image.append(reinterpret_cast<const char*>(&header), sizeof(header));
+	if (!table.empty())
+		image.append(reinterpret_cast<const char*>(&table[0]), table.size() * sizeof(db_image::package_t));
+	if (!files.empty())
+		image.append(reinterpret_cast<const char*>(&files[0]), files.size() * sizeof(uint32_t));
+	if (!index.empty())
+		image.append(reinterpret_cast<const char*>(&index[0]), index.size() * sizeof(db_image::path_t));
+	if (!owners.empty())
+		image.append(reinterpret_cast<const char*>(&owners[0]), owners.size() * sizeof(uint32_t));
+	image.append(strings);
 }
 
-void pkgutil::db_rm_pkg(const string& name, const set<string>& keep_list)
+void pkgutil::db_commit_image(const struct stat& db_stat) const
 {
-	set<string> files = packages[name].files;
-	packages.erase(name);
+	const string filename = root + PKG_DB_BIN;
+	const string filename_new = filename + ".incomplete_transaction";
 
-#ifndef NDEBUG
-	cerr << "Removing package phase 1 (all files in package):" << endl;
-	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
-	cerr << endl;
-#endif
+	string image_data;
+	db_build_image(image_data, &db_stat);
 
-	// Don't delete files found in the keep list
-	for (set<string>::const_iterator i = keep_list.begin(); i != keep_list.end(); ++i)
-		files.erase(*i);
+	if (unlink(filename_new.c_str()) == -1 && errno != ENOENT)
+		throw runtime_error_with_errno("could not remove " + filename_new);
 
-#ifndef NDEBUG
-	cerr << "Removing package phase 2 (files that is in the keep list excluded):" << endl;
-	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
-	cerr << endl;
-#endif
+	int fd_new = creat(filename_new.c_str(), 0444);
+	if (fd_new == -1)
+		throw runtime_error_with_errno("could not create " + filename_new);
 
-	// Don't delete files that still have references
-	for (packages_t::const_iterator i = packages.begin(); i != packages.end(); ++i)
-		for (set<string>::const_iterator j = i->second.files.begin(); j != i->second.files.end(); ++j)
-			files.erase(*j);
+	stdio_filebuf<char> filebuf_new(fd_new, ios::out, getpagesize());
+	ostream image_new(&filebuf_new);
+	image_new.write(image_data.data(), image_data.size());
+	image_new.flush();
 
-#ifndef NDEBUG
-	cerr << "Removing package phase 3 (files that still have references excluded):" << endl;
-	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
-	cerr << endl;
-#endif
+	if (!image_new)
+		throw runtime_error("could not write " + filename_new);
 
-	// Delete the files
-	for (set<string>::const_reverse_iterator i = files.rbegin(); i != files.rend(); ++i) {
-		const string filename = root + *i;
-		if (file_exists(filename) && remove(filename.c_str()) == -1) {
-			if (errno == ENOTEMPTY)
-				continue;
-			const char* msg = strerror(errno);
-			cerr << utilname << ": could not remove " << filename << ": " << msg << endl;
+	if (fsync_counted(fd_new) == -1)
+		throw runtime_error_with_errno("could not synchronize " + filename_new);
+
+	if (rename(filename_new.c_str(), filename.c_str()) == -1)
+		throw runtime_error_with_errno("could not rename " + filename_new + " to " + filename);
+}
+
+void pkgutil::db_index()
+{
+	// Databases read from the text file get an in-memory image
+	// the first time the owner index is needed
+	if (!image.loaded()) {
+		string image_data;
+		db_build_image(image_data, 0);
+		image.load(image_data);
+		dirty.clear();
+	}
+}
+
+void pkgutil::db_find_owners(const string& file, set<string>& owners)
+{
+	db_index();
+
+	// Owners recorded in the image, except packages changed since
+	if (const db_image::path_t* path = image.path_find(file)) {
+		const uint32_t* i = image.path_owners(*path);
+		for (const uint32_t* end = i + path->nowners; i != end; ++i) {
+			const char* name = image.str(image.pkg(*i).name);
+			if (dirty.find(name) == dirty.end())
+				owners.insert(owners.end(), name);
 		}
 	}
+
+	// Packages changed since the image was generated
+	for (set<string>::const_iterator i = dirty.begin(); i != dirty.end(); ++i) {
+		packages_t::const_iterator pkg = packages.find(*i);
+		if (pkg != packages.end() && pkg->second.files.find(file) != pkg->second.files.end())
+			owners.insert(*i);
+	}
 }
 
-void pkgutil::db_rm_files(set<string> files, const set<string>& keep_list)
+//
+// Finds the literals in an extended regular expression that every match
+// must contain: the literal the match starts with when the expression is
+// anchored, and the longest run of literal characters anywhere outside
+// groups and bracket expressions. Exact is set when the expression is
+// nothing but an anchored literal. Returns false for alternations.
+//
+static bool regex_literals(const string& pattern, string& prefix, string& required, bool& exact)
 {
-	// Remove all references
-	for (packages_t::iterator i = packages.begin(); i != packages.end(); ++i)
-		for (set<string>::const_iterator j = files.begin(); j != files.end(); ++j)
-			i->second.files.erase(*j);
-   
-#ifndef NDEBUG
-	cerr << "Removing files:" << endl;
-	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
-	cerr << endl;
-#endif
+	const string::size_type n = pattern.length();
+	bool in_prefix = n && pattern[0] == '^';
+	string::size_type i = in_prefix ? 1 : 0;
+	string run;
+
+	prefix.clear();
+	required.clear();
+	exact = false;
+
+	while (i < n) {
+		char c = pattern[i];
+		bool literal = false;
+
+		// Escaped punctuation is literal, except for the GNU word and
+		// buffer anchors, which like \b, \w and \s end the literal
+		if (c == '\\' && i + 1 < n && ispunct(pattern[i + 1]) && !strchr("<>`'", pattern[i + 1])) {
+			c = pattern[i + 1];
+			literal = true;
+			i += 2;
+		} else if (c == '\\') {
+			i += 2;
+		} else if (c == '[' || c == '(') {
+			// Skip the bracket expression or group
+			int depth = 0;
+			do {
+				if (pattern[i] == '\\') {
+					i++;
+				} else if (pattern[i] == '[') {
+					string::size_type j = i + 1;
+					if (j < n && pattern[j] == '^')
+						j++;
+					if (j < n && pattern[j] == ']')
+						j++;
+					while (j < n && pattern[j] != ']') {
+						if (pattern[j] == '[' && j + 1 < n && strchr(":.=", pattern[j + 1])) {
+							string::size_type end = pattern.find(string(1, pattern[j + 1]) + "]", j + 2);
+							j = end == string::npos ? n : end + 1;
+						}
+						j++;
+					}
+					i = j;
+				} else if (pattern[i] == '(') {
+					depth++;
+				} else if (pattern[i] == ')') {
+					depth--;
+				}
+				i++;
+			} while (i < n && depth > 0);
+		} else if (c == '|') {
+			return false;
+		} else if (c == '$' && i + 1 == n) {
+			exact = in_prefix;
+			i++;
+		} else if (c == '{') {
+			string::size_type end = pattern.find('}', i);
+			i = end == string::npos ? n : end + 1;
+		} else if (strchr(".^$*+?", c)) {
+			i++;
+		} else {
+			literal = true;
+			i++;
+		}
 
-	// Don't delete files found in the keep list
-	for (set<string>::const_iterator i = keep_list.begin(); i != keep_list.end(); ++i)
-		files.erase(*i);
+		// A quantified character may not be there at all, or repeat
+		if (literal && i < n && strchr("*?{", pattern[i]))
+			literal = false;
 
-	// Delete the files
-	for (set<string>::const_reverse_iterator i = files.rbegin(); i != files.rend(); ++i) {
-		const string filename = root + *i;
-		if (file_exists(filename) && remove(filename.c_str()) == -1) {
-			if (errno == ENOTEMPTY)
-				continue;
-			const char* msg = strerror(errno);
-			cerr << utilname << ": could not remove " << filename << ": " << msg << endl;
+		if (literal) {
+			run += c;
+			if (in_prefix)
+				prefix += c;
+		}
+
+		if (!literal || (i < n && pattern[i] == '+')) {
+			if (run.length() > required.length())
+				required = run;
+			run.clear();
+			in_prefix = false;
 		}
 	}
+
+	if (run.length() > required.length())
+		required = run;
+
+	return true;
 }
 
-set<string> pkgutil::db_find_conflicts(const string& name, const pkginfo_t& info)
-{
-	set<string> files;
-   
-	// Find conflicting files in database
-	for (packages_t::const_iterator i = packages.begin(); i != packages.end(); ++i) {
-		if (i->first != name) {
-			set_intersection(info.files.begin(), info.files.end(),
-					 i->second.files.begin(), i->second.files.end(),
-					 inserter(files, files.end()));
-		}
+//
+// Matches paths against a user supplied expression the way they are
+// printed, with a leading slash, without allocating a string per path.
+//
+class path_matcher {
+public:
+	explicit path_matcher(const string& pattern)
+	{
+		if (regcomp(&preg, pattern.c_str(), REG_EXTENDED | REG_NOSUB))
+			throw runtime_error("error compiling regular expression '" + pattern + "', aborting");
+		if (!regex_literals(pattern, prefix, required, exact))
+			prefix.clear(), required.clear(), exact = false;
+		buffer.push_back('/');
 	}
-	
-#ifndef NDEBUG
-	cerr << "Conflicts phase 1 (conflicts in database):" << endl;
-	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
-	cerr << endl;
-#endif
 
-	// Find conflicting files in filesystem
-	for (set<string>::iterator i = info.files.begin(); i != info.files.end(); ++i) {
-		const string filename = root + *i;
-		if (file_exists(filename) && files.find(*i) == files.end())
-			files.insert(files.end(), *i);
+	~path_matcher() { regfree(&preg); }
+
+	bool match(const char* path)
+	{
+		size_t length = strlen(path);
+		buffer.resize(length + 2);
+		memcpy(&buffer[1], path, length + 1);
+
+		if (!required.empty() && !memmem(&buffer[0], length + 1, required.data(), required.length()))
+			return false;
+
+		return !regexec(&preg, &buffer[0], 0, 0, 0);
+	}
+
+	string prefix;
+	string required;
+	bool exact;
+
+private:
+	path_matcher(const path_matcher&);
+	path_matcher& operator=(const path_matcher&);
+
+	regex_t preg;
+	vector<char> buffer;
+};
+
+void pkgutil::db_find_owners(const string& pattern, vector<pair<string, string> >& result)
+{
+	pkg_stats::phase phase("db_find_owners");
+
+	path_matcher matcher(pattern);
+	db_index();
+
+	// Anchored expressions only need to look at the paths starting with
+	// their literal prefix, a slash followed by the path in the index
+	uint32_t first = 0;
+	uint32_t last = image.path_count();
+	string start;
+
+	if (!matcher.prefix.empty()) {
+		if (matcher.prefix[0] != '/')
+			return;
+
+		start = matcher.prefix.substr(1);
+		if (matcher.exact) {
+			const db_image::path_t* path = image.path_find(start);
+			first = path ? path - &image.path(0) : last;
+			last = path ? first + 1 : last;
+		} else {
+			first = image.path_lower_bound(start.c_str());
+		}
+	}
+
+	const size_t count = result.size();
+	for (uint32_t i = first; i < last; ++i) {
+		const db_image::path_t& path = image.path(i);
+		const char* name = image.str(path.path);
+
+		if (!start.empty() && strncmp(name, start.c_str(), start.length()))
+			break;
+
+		if (!matcher.match(name))
+			continue;
+
+		const uint32_t* owner = image.path_owners(path);
+		for (const uint32_t* end = owner + path.nowners; owner != end; ++owner) {
+			const char* pkg = image.str(image.pkg(*owner).name);
+			if (dirty.find(pkg) == dirty.end())
+				result.push_back(pair<string, string>(pkg, name));
+		}
+	}
+
+	// Packages changed since the image was generated
+	for (set<string>::const_iterator i = dirty.begin(); i != dirty.end(); ++i) {
+		packages_t::const_iterator pkg = packages.find(*i);
+		if (pkg == packages.end())
+			continue;
+
+		const file_list& files = pkg->second.files;
+		for (file_list::const_iterator j = files.lower_bound(start.c_str()); j != files.end(); ++j) {
+			if (strncmp(*j, start.c_str(), start.length()))
+				break;
+			if (matcher.match(*j))
+				result.push_back(pair<string, string>(*i, *j));
+		}
+	}
+
+	// Ordered by package, then by file
+	sort(result.begin() + count, result.end());
+}
+
+void pkgutil::db_load_files(const string& name)
+{
+	if (unloaded.find(name) == unloaded.end())
+		return;
+
+	pkginfo_t& info = packages[name];
+	vector<const char*> files;
+	db_list_files(name, info, files);
+	unloaded.erase(name);
+
+	for (vector<const char*>::const_iterator i = files.begin(); i != files.end(); ++i)
+		info.files.insert(*i);
+}
+
+void pkgutil::db_add_pkg(const string& name, const pkginfo_t& info)
+{
+	unloaded.erase(name);
+	dirty.insert(name);
+	pending.insert(name);
+	packages[name] = info;
+	ldconfig_trigger(info.files);
+}
+
+bool pkgutil::db_find_pkg(const string& name)
+{
+	return (packages.find(name) != packages.end());
+}
+
+void pkgutil::db_rm_pkg(const string& name)
+{
+	pkg_stats::phase phase("db_rm_pkg");
+
+	set<string> names;
+	names.insert(name);
+	db_rm_pkgs(names);
+}
+
+void pkgutil::db_rm_pkgs(const set<string>& names)
+{
+	pkg_stats::phase phase("db_rm_pkg");
+
+	// The files of all packages are collected before any of them is
+	// dropped, so that every file is checked for references only once
+	set<string> files;
+	for (set<string>::const_iterator i = names.begin(); i != names.end(); ++i) {
+		db_load_files(*i);
+		const file_list& pkg_files = packages[*i].files;
+		files.insert(pkg_files.begin(), pkg_files.end());
+	}
+
+	for (set<string>::const_iterator i = names.begin(); i != names.end(); ++i) {
+		packages.erase(*i);
+		dirty.insert(*i);
+		pending.insert(*i);
+	}
+
+#ifndef NDEBUG
+	cerr << "Removing package phase 1 (all files in package):" << endl;
+	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
+	cerr << endl;
+#endif
+
+	// Don't delete files that still have references
+	for (set<string>::iterator i = files.begin(); i != files.end();) {
+		set<string> owners;
+		db_find_owners(*i, owners);
+		if (owners.empty())
+			++i;
+		else
+			files.erase(i++);
+	}
+
+#ifndef NDEBUG
+	cerr << "Removing package phase 2 (files that still have references excluded):" << endl;
+	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
+	cerr << endl;
+#endif
+
+	// Delete the files
+	ldconfig_trigger(files);
+	remove_files(files, false);
+}
+
+void pkgutil::db_rm_pkg(const string& name, const set<string>& keep_list)
+{
+	pkg_stats::phase phase("db_rm_pkg");
+
+	db_load_files(name);
+
+	const file_list& pkg_files = packages[name].files;
+	set<string> files(pkg_files.begin(), pkg_files.end());
+	packages.erase(name);
+	dirty.insert(name);
+	pending.insert(name);
+
+#ifndef NDEBUG
+	cerr << "Removing package phase 1 (all files in package):" << endl;
+	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
+	cerr << endl;
+#endif
+
+	// Don't delete files found in the keep list
+	for (set<string>::const_iterator i = keep_list.begin(); i != keep_list.end(); ++i)
+		files.erase(*i);
+
+#ifndef NDEBUG
+	cerr << "Removing package phase 2 (files that is in the keep list excluded):" << endl;
+	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
+	cerr << endl;
+#endif
+
+	// Don't delete files that still have references
+	for (set<string>::iterator i = files.begin(); i != files.end();) {
+		set<string> owners;
+		db_find_owners(*i, owners);
+		if (owners.empty())
+			++i;
+		else
+			files.erase(i++);
+	}
+
+#ifndef NDEBUG
+	cerr << "Removing package phase 3 (files that still have references excluded):" << endl;
+	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
+	cerr << endl;
+#endif
+
+	// Delete the files
+	ldconfig_trigger(files);
+	remove_files(files, true);
+}
+
+void pkgutil::db_rm_files(set<string> files, const set<string>& keep_list)
+{
+	pkg_stats::phase phase("db_rm_files");
+
+	// Remove all references
+	for (set<string>::const_iterator i = files.begin(); i != files.end(); ++i) {
+		set<string> owners;
+		db_find_owners(*i, owners);
+		for (set<string>::const_iterator j = owners.begin(); j != owners.end(); ++j) {
+			db_load_files(*j);
+			packages[*j].files.erase(*i);
+			dirty.insert(*j);
+			pending.insert(*j);
+		}
+	}
+   
+#ifndef NDEBUG
+	cerr << "Removing files:" << endl;
+	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
+	cerr << endl;
+#endif
+
+	// Don't delete files found in the keep list
+	for (set<string>::const_iterator i = keep_list.begin(); i != keep_list.end(); ++i)
+		files.erase(*i);
+
+	// Delete the files
+	remove_files(files, true);
+}
+
+//
+// One io_ring per worker of a thread pool, set up the first time the
+// worker has a batch large enough to be worth it.
+//
+class io_rings {
+public:
+	explicit io_rings(unsigned int workers) : rings(workers, static_cast<io_ring*>(0)) {}
+	~io_rings()
+	{
+		for (vector<io_ring*>::iterator i = rings.begin(); i != rings.end(); ++i)
+			delete *i;
+	}
+
+	io_ring* get(unsigned int worker, size_t batch)
+	{
+		if (batch < IO_RING_MIN_BATCH || worker >= rings.size())
+			return 0;
+		if (!rings[worker])
+			rings[worker] = new io_ring;
+		return rings[worker]->available() ? rings[worker] : 0;
+	}
+private:
+	vector<io_ring*> rings;
+};
+
+//
+// Looks up the files of one directory relative to a descriptor of that
+// directory, instead of resolving the whole path for every file. Larger
+// directories are looked up with one io_uring submission.
+//
+class probe_job : public thread_pool::job {
+public:
+	probe_job(int root, const string& dir, set<string>& found, pthread_mutex_t& mutex, io_rings& rings)
+		: root(root), dir(dir), found(found), mutex(mutex), rings(rings) {}
+
+	vector<const char*> files;
+
+	void run(unsigned int worker)
+	{
+		vector<const char*> existing;
+
+		int fd = openat(root, dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+		if (fd != -1) {
+			if (!probe(rings.get(worker, files.size()), fd, existing))
+				probe(fd, dir.length(), existing);
+			close(fd);
+		} else if (errno != ENOENT && errno != ENOTDIR) {
+			// Let the kernel report on every file
+			probe(root, 0, existing);
+		}
+
+		pthread_mutex_lock(&mutex);
+		for (vector<const char*>::const_iterator i = existing.begin(); i != existing.end(); ++i)
+			found.insert(*i);
+		pthread_mutex_unlock(&mutex);
+	}
+private:
+	void probe(int fd, size_t skip, vector<const char*>& existing) const
+	{
+		struct stat buf;
+		pkg_stats::add(pkg_stats::LSTAT_CALLS, files.size());
+		for (vector<const char*>::const_iterator i = files.begin(); i != files.end(); ++i)
+			if (!fstatat(fd, *i + skip, &buf, AT_SYMLINK_NOFOLLOW))
+				existing.push_back(*i);
+	}
+
+	bool probe(io_ring* ring, int fd, vector<const char*>& existing) const
+	{
+		if (!ring)
+			return false;
+		for (vector<const char*>::const_iterator i = files.begin(); i != files.end(); ++i)
+			ring->statx(fd, *i + dir.length(), AT_SYMLINK_NOFOLLOW);
+		const bool submitted = ring->submit();
+		for (size_t i = 0; submitted && i < files.size(); ++i)
+			if (ring->results()[i] == 0)
+				existing.push_back(files[i]);
+		if (submitted)
+			pkg_stats::add(pkg_stats::LSTAT_CALLS, files.size());
+		ring->clear();
+		return submitted;
+	}
+
+	int root;
+	string dir;
+	set<string>& found;
+	pthread_mutex_t& mutex;
+	io_rings& rings;
+};
+
+void pkgutil::probe_files(const file_list& files, set<string>& found) const
+{
+	// Directories are never conflicts, so only the other files are
+	// looked up, grouped by the directory they are in
+	map<string, vector<const char*> > dirs;
+	for (file_list::const_iterator i = files.begin(); i != files.end(); ++i) {
+		const char* slash = strrchr(*i, '/');
+		if (!slash || slash[1])
+			dirs[string(*i, slash ? slash + 1 - *i : 0)].push_back(*i);
+	}
+
+	int fd = open(root.empty() ? "." : root.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd == -1) {
+		for (file_list::const_iterator i = files.begin(); i != files.end(); ++i)
+			if (file_exists(root + *i))
+				found.insert(*i);
+		return;
+	}
+
+	pthread_mutex_t mutex;
+	pthread_mutex_init(&mutex, 0);
+	{
+		io_rings rings(jobs + 1);
+		thread_pool pool(jobs > 1 ? jobs : 0);
+		for (map<string, vector<const char*> >::iterator i = dirs.begin(); i != dirs.end(); ++i) {
+			probe_job* job = new probe_job(fd, i->first, found, mutex, rings);
+			job->files.swap(i->second);
+			pool.add(job);
+		}
+	}
+	pthread_mutex_destroy(&mutex);
+	close(fd);
+}
+
+//
+// Removes the files of one directory relative to a descriptor of that
+// directory. Failures are collected and reported by the caller, in the
+// order the files were removed in before they were spread over threads.
+// Larger directories are unlinked with one io_uring submission.
+//
+class remove_job : public thread_pool::job {
+public:
+	remove_job(int root, const string& dir, bool keep_non_empty, map<string, int>& errors, pthread_mutex_t& mutex, io_rings& rings)
+		: root(root), dir(dir), keep_non_empty(keep_non_empty), errors(errors), mutex(mutex), rings(rings) {}
+
+	vector<const string*> files;
+
+	void run(unsigned int worker)
+	{
+		vector<pair<const string*, int> > failed;
+
+		int fd = openat(root, dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+		if (fd != -1) {
+			if (!remove(rings.get(worker, files.size()), fd, failed))
+				for (vector<const string*>::const_iterator i = files.begin(); i != files.end(); ++i)
+					remove(fd, (*i)->c_str() + dir.length(), *i, failed);
+			close(fd);
+		} else if (errno != ENOENT && errno != ENOTDIR) {
+			for (vector<const string*>::const_iterator i = files.begin(); i != files.end(); ++i)
+				remove(root, (*i)->c_str(), *i, failed);
+		}
+
+		pthread_mutex_lock(&mutex);
+		for (vector<pair<const string*, int> >::const_iterator i = failed.begin(); i != failed.end(); ++i)
+			errors[*i->first] = i->second;
+		pthread_mutex_unlock(&mutex);
+	}
+private:
+	void remove(int fd, const char* name, const string* file, vector<pair<const string*, int> >& failed) const
+	{
+		// Same as remove(3), files that are already gone are not an error
+		if (unlinkat(fd, name, 0) == 0) {
+			pkg_stats::add(pkg_stats::FILES_UNLINKED);
+			return;
+		}
+		if (errno != ENOENT)
+			unlink_failed(fd, name, file, failed);
+	}
+
+	bool remove(io_ring* ring, int fd, vector<pair<const string*, int> >& failed) const
+	{
+		if (!ring)
+			return false;
+		for (vector<const string*>::const_iterator i = files.begin(); i != files.end(); ++i)
+			ring->unlinkat(fd, (*i)->c_str() + dir.length(), 0);
+		const bool submitted = ring->submit();
+		for (size_t i = 0; submitted && i < files.size(); ++i) {
+			const int result = ring->results()[i];
+			if (result == 0)
+				pkg_stats::add(pkg_stats::FILES_UNLINKED);
+			if (result == 0 || result == -ENOENT)
+				continue;
+			errno = -result;
+			unlink_failed(fd, files[i]->c_str() + dir.length(), files[i], failed);
+		}
+		ring->clear();
+		return submitted;
+	}
+
+	void unlink_failed(int fd, const char* name, const string* file, vector<pair<const string*, int> >& failed) const
+	{
+		if (errno == EISDIR && unlinkat(fd, name, AT_REMOVEDIR) == 0) {
+			pkg_stats::add(pkg_stats::FILES_UNLINKED);
+			return;
+		}
+		if (errno == ENOTEMPTY && keep_non_empty)
+			return;
+		failed.push_back(make_pair(file, errno));
+	}
+
+	int root;
+	string dir;
+	bool keep_non_empty;
+	map<string, int>& errors;
+	pthread_mutex_t& mutex;
+	io_rings& rings;
+};
+
+void pkgutil::remove_files(const set<string>& files, bool keep_non_empty) const
+{
+	map<string, int> errors;
+	bool directories_only = false;
+
+	// Other files are removed directory by directory in parallel,
+	// directories afterwards, innermost first
+	int fd = open(root.empty() ? "." : root.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd != -1) {
+		map<string, vector<const string*> > dirs;
+		for (set<string>::const_iterator i = files.begin(); i != files.end(); ++i)
+			if ((*i)[i->length() - 1] != '/')
+				dirs[i->substr(0, i->rfind('/') + 1)].push_back(&*i);
+
+		pthread_mutex_t mutex;
+		pthread_mutex_init(&mutex, 0);
+		{
+			io_rings rings(jobs + 1);
+			thread_pool pool(jobs > 1 ? jobs : 0);
+			for (map<string, vector<const string*> >::iterator i = dirs.begin(); i != dirs.end(); ++i) {
+				remove_job* job = new remove_job(fd, i->first, keep_non_empty, errors, mutex, rings);
+				job->files.swap(i->second);
+				pool.add(job);
+			}
+		}
+		pthread_mutex_destroy(&mutex);
+		close(fd);
+		directories_only = true;
+	}
+
+	for (set<string>::const_reverse_iterator i = files.rbegin(); i != files.rend(); ++i) {
+		if (directories_only && (*i)[i->length() - 1] != '/')
+			continue;
+		const string filename = root + *i;
+		if (!file_exists(filename))
+			continue;
+		if (remove(filename.c_str()) == 0)
+			pkg_stats::add(pkg_stats::FILES_UNLINKED);
+		else if (errno != ENOTEMPTY || !keep_non_empty)
+			errors[*i] = errno;
+	}
+
+	for (map<string, int>::const_reverse_iterator i = errors.rbegin(); i != errors.rend(); ++i)
+		cerr << utilname << ": could not remove " << root + i->first << ": " << strerror(i->second) << endl;
+}
+
+bool pkgutil::db_read_sums(const string& name, const string& version, file_sums_t& sums) const
+{
+	// Sums written for another version of the package are of no use,
+	// and neither are sums that cannot be read, they only spare reading
+	// the files
+	const string filename = root + PKG_SUMS + "/" + name;
+	ifstream in(filename.c_str());
+	string line;
+	if (!getline(in, line) || line != version)
+		return false;
+
+	while (getline(in, line)) {
+		file_sum_t sum;
+		unsigned long long hash;
+		long long size;
+		long long mtime;
+		int path = 0;
+		if (sscanf(line.c_str(), "%16llx %lld %lld %n", &hash, &size, &mtime, &path) < 3 || path <= 0) {
+			cerr << utilname << ": invalid entry in " << filename << ", ignoring recorded sums" << endl;
+			sums.clear();
+			return false;
+		}
+		sum.hash = hash;
+		sum.size = size;
+		sum.mtime = mtime;
+		sums[line.substr(path)] = sum;
+	}
+
+	return true;
+}
+
+void pkgutil::db_write_sums(const string& name, const string& version, const file_sums_t& sums) const
+{
+	const string dir = root + PKG_SUMS;
+	const string filename = dir + "/" + name;
+	const string filename_new = filename + ".incomplete_transaction";
+
+	if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST)
+		throw runtime_error_with_errno("could not create " + dir);
+
+	FILE* out = fopen(filename_new.c_str(), "w");
+	if (!out)
+		throw runtime_error_with_errno("could not create " + filename_new);
+
+	fprintf(out, "%s\n", version.c_str());
+	for (file_sums_t::const_iterator i = sums.begin(); i != sums.end(); ++i)
+		fprintf(out, "%016llx %lld %lld %s\n", (unsigned long long)i->second.hash,
+		        (long long)i->second.size, (long long)i->second.mtime, i->first.c_str());
+
+	// Synchronize the sums before they replace the old ones, a torn
+	// file would leave the package without any
+	bool failed = fflush(out) || ferror(out) || fsync_counted(fileno(out)) == -1;
+	if (fclose(out) || failed) {
+		unlink(filename_new.c_str());
+		throw runtime_error("could not write " + filename_new);
+	}
+
+	if (rename(filename_new.c_str(), filename.c_str()) == -1)
+		throw runtime_error_with_errno("could not rename " + filename_new + " to " + filename);
+}
+
+void pkgutil::db_rm_sums(const string& name) const
+{
+	const string filename = root + PKG_SUMS + "/" + name;
+	if (unlink(filename.c_str()) == -1 && errno != ENOENT)
+		throw runtime_error_with_errno("could not remove " + filename);
+}
+
+//
+// Checks a number of installed files of one package against their sums.
+//
+class verify_job : public thread_pool::job {
+public:
+	verify_job(const string& root, const string& package, bool quick, map<pair<string, string>, string>& problems, pthread_mutex_t& mutex)
+		: root(root), package(package), quick(quick), problems(problems), mutex(mutex) {}
+
+	vector<pair<string, pkgutil::file_sum_t> > files;
+
+	void run(unsigned int)
+	{
+		vector<pair<string, string> > found;
+
+		for (vector<pair<string, pkgutil::file_sum_t> >::const_iterator i = files.begin(); i != files.end(); ++i) {
+			const char* problem = check(root + i->first, i->second);
+			if (problem)
+				found.push_back(make_pair(i->first, string(problem)));
+		}
+
+		pthread_mutex_lock(&mutex);
+		for (vector<pair<string, string> >::const_iterator i = found.begin(); i != found.end(); ++i)
+			problems[make_pair(package, i->first)] = i->second;
+		pthread_mutex_unlock(&mutex);
+	}
+private:
+	const char* check(const string& filename, const pkgutil::file_sum_t& sum) const
+	{
+		struct stat buf;
+		if (lstat_counted(filename.c_str(), &buf) == -1)
+			return errno == ENOENT ? "missing" : "unreadable";
+		if (!S_ISREG(buf.st_mode))
+			return "replaced";
+		if (buf.st_size != sum.size)
+			return "changed";
+		if (quick && buf.st_mtime == sum.mtime)
+			return 0;
+
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd == -1)
+			return "unreadable";
+		uint64_t hash;
+		bool read = file_hash(fd, hash);
+		close(fd);
+		if (!read)
+			return "unreadable";
+		return hash == sum.hash ? 0 : "changed";
+	}
+
+	string root;
+	string package;
+	bool quick;
+	map<pair<string, string>, string>& problems;
+	pthread_mutex_t& mutex;
+};
+
+void pkgutil::db_verify(const set<string>& names, bool quick, map<pair<string, string>, string>& problems, set<string>& unrecorded)
+{
+	pkg_stats::phase phase("db_verify");
+
+	pthread_mutex_t mutex;
+	pthread_mutex_init(&mutex, 0);
+	{
+		thread_pool pool(jobs > 1 ? jobs : 0);
+
+		for (set<string>::const_iterator i = names.begin(); i != names.end(); ++i) {
+			const pkginfo_t& info = packages[*i];
+			file_sums_t sums;
+			if (!db_read_sums(*i, info.version, sums)) {
+				unrecorded.insert(*i);
+				continue;
+			}
+
+			// Files that have since gone to another package are
+			// left to that package
+			vector<const char*> files;
+			db_list_files(*i, info, files);
+
+			verify_job* job = 0;
+			for (vector<const char*>::const_iterator j = files.begin(); j != files.end(); ++j) {
+				file_sums_t::const_iterator sum = sums.find(*j);
+				if (sum == sums.end())
+					continue;
+				if (!job)
+					job = new verify_job(root, *i, quick, problems, mutex);
+				job->files.push_back(*sum);
+				if (job->files.size() == 64) {
+					pool.add(job);
+					job = 0;
+				}
+			}
+			if (job)
+				pool.add(job);
+		}
+	}
+	pthread_mutex_destroy(&mutex);
+}
+
+set<string> pkgutil::db_find_conflicts(const string& name, const pkginfo_t& info)
+{
+	pkg_stats::phase phase("db_find_conflicts");
+
+	set<string> files;
+   
+	// Find conflicting files in database
+	for (file_list::const_iterator i = info.files.begin(); i != info.files.end(); ++i) {
+		set<string> owners;
+		db_find_owners(*i, owners);
+		owners.erase(name);
+		if (!owners.empty())
+			files.insert(files.end(), *i);
+	}
+	
+#ifndef NDEBUG
+	cerr << "Conflicts phase 1 (conflicts in database):" << endl;
+	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
+	cerr << endl;
+#endif
+
+	// Find conflicting files in filesystem
+	probe_files(info.files, files);
+
+#ifndef NDEBUG
+	cerr << "Conflicts phase 2 (conflicts in filesystem added):" << endl;
+	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
+	cerr << endl;
+#endif
+
+	// Exclude directories
+	set<string> tmp = files;
+	for (set<string>::const_iterator i = tmp.begin(); i != tmp.end(); ++i) {
+		if ((*i)[i->length() - 1] == '/')
+			files.erase(*i);
+	}
+
+#ifndef NDEBUG
+	cerr << "Conflicts phase 3 (directories excluded):" << endl;
+	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
+	cerr << endl;
+#endif
+
+	// If this is an upgrade, remove files already owned by this package
+	if (packages.find(name) != packages.end()) {
+		db_load_files(name);
+
+		for (file_list::const_iterator i = packages[name].files.begin(); i != packages[name].files.end(); ++i)
+			files.erase(*i);
+
+#ifndef NDEBUG
+		cerr << "Conflicts phase 4 (files already owned by this package excluded):" << endl;
+		copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
+		cerr << endl;
+#endif
+	}
+
+	return files;
+}
+
+//
+// Inflates one member of a chunked gzip file.
+//
+class inflate_job : public thread_pool::job {
+public:
+	inflate_job(const vector<unsigned char>& in, unsigned char* out, uint32_t size, uint32_t crc, bool& ok)
+		: in(in), out(out), size(size), crc(crc), ok(ok) {}
+
+	void run(unsigned int)
+	{
+		unsigned char empty;
+		z_stream stream;
+		memset(&stream, 0, sizeof(stream));
+		if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+			return;
+
+		stream.next_in = const_cast<unsigned char*>(&in[0]);
+		stream.avail_in = in.size();
+		stream.next_out = size ? out : &empty;
+		stream.avail_out = size;
+		ok = inflate(&stream, Z_FINISH) == Z_STREAM_END && stream.avail_out == 0 &&
+		     crc32(0, out, size) == crc;
+		inflateEnd(&stream);
+	}
+private:
+	const vector<unsigned char>& in;
+	unsigned char* out;
+	uint32_t size;
+	uint32_t crc;
+	bool& ok;
+};
+
+//
+// Reader for gzip files made of small members that each carry their own
+// compressed size in a "BC" extra field, as written by bgzip(1). Such a
+// file is an ordinary gzip file to any other reader, but its members can
+// be found without inflating anything, so they are inflated on all the
+// worker threads while libarchive works through the previous batch.
+//
+class chunked_gzip {
+public:
+	static chunked_gzip* open(const string& filename, unsigned int threads);
+	static ssize_t read(struct archive* archive, void* data, const void** buffer);
+	static int close(struct archive* archive, void* data);
+private:
+	struct chunk_t {
+		vector<unsigned char> data;
+		uint32_t size;
+		uint32_t crc;
+		bool ok;
+	};
+
+	chunked_gzip(FILE* file, unsigned int threads);
+	~chunked_gzip();
+	bool read_chunk(chunk_t& chunk);
+	void start_batch();
+
+	FILE* file;
+	vector<char> file_buffer;
+	unsigned int batch_size;
+	vector<chunk_t> chunks;
+	vector<unsigned char> next;
+	vector<unsigned char> current;
+	string error;
+	bool end;
+	thread_pool pool;
+};
+
+chunked_gzip::chunked_gzip(FILE* file, unsigned int threads)
+	: file(file), file_buffer(1024 * 1024), batch_size((threads + 1) * CHUNKS_PER_THREAD),
+	  end(false), pool(threads, batch_size)
+{
+	setvbuf(file, &file_buffer[0], _IOFBF, file_buffer.size());
+}
+
+chunked_gzip::~chunked_gzip()
+{
+	pool.wait();
+	fclose(file);
+}
+
+chunked_gzip* chunked_gzip::open(const string& filename, unsigned int threads)
+{
+	FILE* file = fopen(filename.c_str(), "r");
+	if (!file)
+		return 0;
+
+	// Only the header of the first member is looked at, a file that
+	// turns out to be chunked only in part fails while it is read
+	unsigned char header[18];
+	if (fread(header, 1, sizeof(header), file) != sizeof(header) ||
+	    header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 || header[3] != 4 ||
+	    header[10] != 6 || header[11] != 0 || header[12] != 'B' || header[13] != 'C' ||
+	    header[14] != 2 || header[15] != 0) {
+		fclose(file);
+		return 0;
+	}
+	rewind(file);
+
+	return new chunked_gzip(file, threads > 1 ? threads : 0);
+}
+
+bool chunked_gzip::read_chunk(chunk_t& chunk)
+{
+	unsigned char header[18];
+	size_t length = fread(header, 1, sizeof(header), file);
+	if (length == 0 && feof(file)) {
+		end = true;
+		return false;
+	}
+
+	if (length != sizeof(header) || header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 || header[3] != 4 ||
+	    header[10] != 6 || header[11] != 0 || header[12] != 'B' || header[13] != 'C') {
+		error = "invalid gzip chunk";
+		return false;
+	}
+
+	// The block size counts the whole member, header and trailer included
+	size_t block_size = (header[16] | header[17] << 8) + 1;
+	if (block_size < sizeof(header) + 8) {
+		error = "invalid gzip chunk";
+		return false;
+	}
+
+	chunk.data.resize(block_size - sizeof(header));
+	if (fread(&chunk.data[0], 1, chunk.data.size(), file) != chunk.data.size()) {
+		error = "truncated gzip chunk";
+		return false;
+	}
+
+	const unsigned char* trailer = &chunk.data[chunk.data.size() - 8];
+	chunk.crc = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | (uint32_t)trailer[3] << 24;
+	chunk.size = trailer[4] | trailer[5] << 8 | trailer[6] << 16 | (uint32_t)trailer[7] << 24;
+	chunk.data.resize(chunk.data.size() - 8);
+	chunk.ok = false;
+	if (chunk.size > CHUNK_SIZE_MAX) {
+		error = "invalid gzip chunk";
+		return false;
+	}
+
+	return true;
+}
+
+void chunked_gzip::start_batch()
+{
+	chunks.resize(batch_size);
+	unsigned int n = 0;
+	while (n < batch_size && error.empty() && read_chunk(chunks[n]))
+		++n;
+	chunks.resize(n);
+
+	size_t size = 0;
+	for (unsigned int i = 0; i < n; ++i)
+		size += chunks[i].size;
+	next.resize(size);
+
+	unsigned char* out = next.empty() ? 0 : &next[0];
+	for (unsigned int i = 0; i < n; ++i) {
+		pool.add(new inflate_job(chunks[i].data, out, chunks[i].size, chunks[i].crc, chunks[i].ok));
+		out += chunks[i].size;
+	}
+}
+
+ssize_t chunked_gzip::read(struct archive* archive, void* data, const void** buffer)
+{
+	chunked_gzip* self = static_cast<chunked_gzip*>(data);
+
+	do {
+		if (self->chunks.empty() && (self->end || !self->error.empty())) {
+			if (!self->error.empty()) {
+				archive_set_error(archive, EINVAL, "%s", self->error.c_str());
+				return -1;
+			}
+			return 0;
+		}
+
+		if (self->chunks.empty())
+			self->start_batch();
+		self->pool.wait();
+
+		for (vector<chunk_t>::const_iterator i = self->chunks.begin(); i != self->chunks.end(); ++i) {
+			if (!i->ok) {
+				archive_set_error(archive, EINVAL, "invalid gzip chunk");
+				return -1;
+			}
+		}
+
+		// The next batch is inflated while this one is being used
+		self->current.swap(self->next);
+		self->chunks.clear();
+		if (!self->end && self->error.empty())
+			self->start_batch();
+	} while (self->current.empty());
+
+	*buffer = &self->current[0];
+	return self->current.size();
+}
+
+int chunked_gzip::close(struct archive*, void* data)
+{
+	delete static_cast<chunked_gzip*>(data);
+	return ARCHIVE_OK;
+}
+
+//
+// Opens a package for reading, through chunked_gzip when it is made of
+// gzip chunks and through libarchive's own filters otherwise.
+//
+static int open_package(struct archive* archive, const string& filename, unsigned int threads)
+{
+	chunked_gzip* chunks = chunked_gzip::open(filename, threads);
+	if (chunks)
+		return archive_read_open(archive, chunks, 0, chunked_gzip::read, chunked_gzip::close);
+
+	return archive_read_open_filename(archive, const_cast<char*>(filename.c_str()), ARCHIVE_DEFAULT_BYTES_PER_BLOCK);
+}
+
+pair<string, pkgutil::pkginfo_t> pkgutil::pkg_open(const string& filename) const
+{
+	string stage;
+	return pkg_open(filename, stage);
+}
+
+static void package_name(const string& filename, pair<string, pkgutil::pkginfo_t>& result)
+{
+	string basename(filename, filename.rfind('/') + 1);
+	string name(basename, 0, basename.find(VERSION_DELIM));
+	string::size_type extension = string::npos;
+	for (size_t n = 0; n < sizeof(pkg_extensions) / sizeof(pkg_extensions[0]) && extension == string::npos; ++n)
+		extension = basename.rfind(pkg_extensions[n]);
+	string version(basename, 0, extension);
+	version.erase(0, version.find(VERSION_DELIM) == string::npos ? string::npos : version.find(VERSION_DELIM) + 1);
+   
+	if (name.empty() || version.empty())
+		throw runtime_error("could not determine name and/or version of " + basename + ": Invalid package name");
+
+	result.first = name;
+	result.second.version = version;
+}
+
+pair<string, pkgutil::pkginfo_t> pkgutil::pkg_open(const string& filename, string& stage) const
+{
+	pkg_stats::phase phase("pkg_open");
+
+	pair<string, pkginfo_t> result;
+	unsigned int i;
+	struct archive* archive;
+	struct archive* staged = 0;
+	struct archive_entry* entry;
+
+	// Extract name and version from filename
+	package_name(filename, result);
+
+	// Take the member list from the manifest if there is a valid one,
+	// pkg_install will then be the only pass inflating the package
+	manifest_t manifest;
+	if (pkg_read_manifest(filename, manifest)) {
+		for (manifest_t::const_iterator i = manifest.begin(); i != manifest.end(); ++i)
+			result.second.files.append(i->path.c_str());
+		result.second.files.sort();
+
+		if (!stage.empty()) {
+			unlink(stage.c_str());
+			stage.clear();
+		}
+
+		return result;
+	}
+
+	archive = archive_read_new();
+	archive_guard reader(archive, archive_read_finish);
+	INIT_ARCHIVE(archive);
+
+	if (open_package(archive, filename, jobs) != ARCHIVE_OK)
+		throw runtime_error_with_errno("could not open " + filename, archive_errno(archive));
+
+	// While the archive is inflated anyway, keep an uncompressed
+	// copy that pkg_install can extract without inflating it again.
+	// Staging is best effort, pkg_install falls back to the package.
+	archive_guard writer(0, archive_write_finish);
+	if (!stage.empty()) {
+		staged = archive_write_new();
+		writer.reset(staged);
+		archive_write_set_compression_none(staged);
+		archive_write_set_format_pax_restricted(staged);
+		if (archive_write_open_filename(staged, stage.c_str()) != ARCHIVE_OK) {
+			writer.finish();
+			staged = 0;
+		}
+	}
+
+	for (i = 0; archive_read_next_header(archive, &entry) ==
+	     ARCHIVE_OK; ++i) {
+
+		result.second.files.append(archive_entry_pathname(entry));
+
+		mode_t mode = archive_entry_mode(entry);
+
+		if (staged && archive_write_header(staged, entry) != ARCHIVE_OK) {
+			writer.finish();
+			staged = 0;
+		}
+
+		if (S_ISREG(mode) && staged) {
+			char buf[65536];
+			ssize_t len;
+
+			while ((len = archive_read_data(archive, buf, sizeof(buf))) > 0) {
+				if (archive_write_data(staged, buf, len) != len) {
+					writer.finish();
+					staged = 0;
+					break;
+				}
+			}
+
+			if (len < 0)
+				throw runtime_error_with_errno("could not read " + filename, archive_errno(archive));
+		}
+
+		if (S_ISREG(mode) && !staged &&
+		    archive_read_data_skip(archive) != ARCHIVE_OK)
+			throw runtime_error_with_errno("could not read " + filename, archive_errno(archive));
+	}
+   
+	if (i == 0) {
+		if (archive_errno(archive) == 0)
+			throw runtime_error("empty package");
+		else
+			throw runtime_error("could not read " + filename);
+	}
+
+	count_inflated(archive, filename);
+	reader.finish();
+	result.second.files.sort();
+
+	if (staged && archive_write_close(staged) != ARCHIVE_OK)
+		staged = 0;
+	writer.finish();
+
+	if (!staged && !stage.empty()) {
+		unlink(stage.c_str());
+		stage.clear();
+	}
+
+	return result;
+}
+
+//
+// Feeds the holes of a sparse file to a hash as the zeros they read as.
+//
+static void hash_zeros(xxh64& hash, off_t length)
+{
+	static const char zeros[4096] = { 0 };
+	for (; length > 0; length -= sizeof(zeros))
+		hash.update(zeros, length < (off_t)sizeof(zeros) ? length : sizeof(zeros));
+}
+
+//
+// Writes one package member to disk. Data is taken from the buffer when
+// one is given and streamed from the source archive otherwise. Mirrors
+// archive_read_extract(), except that the disk writer is supplied by the
+// caller so that each thread can have its own. The contents of the
+// member are fed to the hash when one is given.
+//
+static int write_entry(struct archive* disk, struct archive_entry* entry,
+                       struct archive* source, const char* data, size_t size,
+                       xxh64* hash, string& error)
+{
+	int status = archive_write_header(disk, entry);
+	if (status != ARCHIVE_OK) {
+		error = archive_error_string(disk);
+	} else if (archive_entry_size(entry) > 0) {
+		if (source) {
+			const void* block;
+			size_t length;
+			off_t offset;
+			off_t hashed = 0;
+			int r;
+			while ((r = archive_read_data_block(source, &block, &length, &offset)) == ARCHIVE_OK) {
+				if (archive_write_data_block(disk, block, length, offset) != ARCHIVE_OK) {
+					error = archive_error_string(disk);
+					status = ARCHIVE_WARN;
+					break;
+				}
+				if (hash) {
+					hash_zeros(*hash, offset - hashed);
+					hash->update(block, length);
+					hashed = offset + length;
+				}
+			}
+			if (r != ARCHIVE_EOF && r != ARCHIVE_OK) {
+				error = archive_error_string(source);
+				status = ARCHIVE_WARN;
+			}
+			if (hash)
+				hash_zeros(*hash, archive_entry_size(entry) - hashed);
+		} else if (archive_write_data(disk, data, size) != static_cast<ssize_t>(size)) {
+			error = archive_error_string(disk);
+			status = ARCHIVE_WARN;
+		} else if (hash) {
+			hash->update(data, size);
+		}
+	}
+
+	int r = archive_write_finish_entry(disk);
+	if (r != ARCHIVE_OK && status == ARCHIVE_OK) {
+		error = archive_error_string(disk);
+		status = r;
+	}
+
+	if (status != ARCHIVE_OK && error.empty())
+		error = "unknown error";
+	else if (status == ARCHIVE_OK)
+		pkg_stats::add(pkg_stats::FILES_WRITTEN);
+
+	return status;
+}
+
+struct install_context {
+	string utilname;
+	vector<struct archive*> disks;
+	pthread_mutex_t output;
+	pkgutil::file_sums_t* sums;
+};
+
+static void add_sum(pkgutil::file_sums_t& sums, const string& filename, const xxh64& hash, off_t size, time_t mtime)
+{
+	pkgutil::file_sum_t& sum = sums[filename];
+	sum.hash = hash.digest();
+	sum.size = size;
+	sum.mtime = mtime;
+}
+
+//
+// Leaves an installed regular file alone when an upgrade would write it
+// again unchanged: the file is as it was when its sum was recorded, the
+// new member has the same contents, owner and permissions, and the file
+// has no other names a rewrite would split off. Only its modification
+// time is set to that of the member.
+//
+static bool keep_unchanged(struct archive* disk, struct archive_entry* entry, const string& filename,
+                           const pkgutil::file_sum_t& sum, const vector<char>& data)
+{
+	struct stat buf;
+	if (lstat_counted(filename.c_str(), &buf) == -1 || !S_ISREG(buf.st_mode) || buf.st_nlink != 1 ||
+	    buf.st_size != sum.size || buf.st_mtime != sum.mtime || (size_t)buf.st_size != data.size())
+		return false;
+
+	if (buf.st_mode != archive_entry_mode(entry) ||
+	    buf.st_uid != (uid_t)archive_write_disk_uid(disk, archive_entry_uname(entry), archive_entry_uid(entry)) ||
+	    buf.st_gid != (gid_t)archive_write_disk_gid(disk, archive_entry_gname(entry), archive_entry_gid(entry)))
+		return false;
+
+	xxh64 hash;
+	if (!data.empty())
+		hash.update(&data[0], data.size());
+	if (hash.digest() != sum.hash)
+		return false;
+
+	if (buf.st_mtime == archive_entry_mtime(entry) && buf.st_mtim.tv_nsec == archive_entry_mtime_nsec(entry))
+		return true;
+
+	struct timespec times[2];
+	times[0].tv_sec = archive_entry_atime(entry);
+	times[0].tv_nsec = archive_entry_atime_is_set(entry) ? archive_entry_atime_nsec(entry) : UTIME_OMIT;
+	times[1].tv_sec = archive_entry_mtime(entry);
+	times[1].tv_nsec = archive_entry_mtime_nsec(entry);
+	return utimensat(AT_FDCWD, filename.c_str(), times, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+//
+// Regular file read into memory by the reader, written by a worker.
+//
+class install_job : public thread_pool::job {
+public:
+	install_job(install_context& c, const string& name, struct archive_entry* e)
+		: context(c), archive_filename(name), entry(archive_entry_clone(e)) {}
+	~install_job() { archive_entry_free(entry); }
+
+	vector<char> data;
+
+	void run(unsigned int worker)
+	{
+		string error;
+		xxh64 hash;
+		if (write_entry(context.disks[worker], entry, 0, data.empty() ? 0 : &data[0], data.size(), &hash, error) != ARCHIVE_OK) {
+			pthread_mutex_lock(&context.output);
+			cerr << context.utilname << ": could not install " + archive_filename << ": " << error << endl;
+			pthread_mutex_unlock(&context.output);
+		} else {
+			pthread_mutex_lock(&context.output);
+			add_sum(*context.sums, archive_filename, hash, archive_entry_size(entry), archive_entry_mtime(entry));
+			pthread_mutex_unlock(&context.output);
+		}
+	}
+private:
+	install_context& context;
+	string archive_filename;
+	struct archive_entry* entry;
+};
+
+void pkgutil::pkg_install(const string& filename, const set<string>& keep_list, const set<string>& non_install_list,
+                          const file_sums_t& installed_sums, file_sums_t& sums) const
+{
+	pkg_stats::phase phase("pkg_install");
+
+	struct archive* archive;
+	struct archive_entry* entry;
+	unsigned int i;
+	char buf[PATH_MAX];
+	string absroot;
+
+	archive = archive_read_new();
+	archive_guard reader(archive, archive_read_finish);
+	INIT_ARCHIVE(archive);
+
+	if (open_package(archive, filename, jobs) != ARCHIVE_OK)
+		throw runtime_error_with_errno("could not open " + filename, archive_errno(archive));
+
+	// Resolve the root without changing directory, later packages of
+	// a transaction and the staged copies may be relative to it
+	if (!realpath(root.c_str(), buf))
+		throw runtime_error_with_errno("could not resolve " + root);
+	absroot = buf;
+
+	// Regular files are handed to the workers, everything else is
+	// extracted here in archive order so that directories, symlinks
+	// and hardlink targets exist before anything depends on them.
+	// Rejected files are also handled here, since checking them may
+	// remove directories below the rejected directory.
+	const unsigned int threads = jobs > 1 ? jobs : 0;
+	install_context context;
+	context.utilname = utilname;
+	context.sums = &sums;
+	pthread_mutex_init(&context.output, 0);
+
+	const int flags = ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_UNLINK;
+	for (unsigned int n = 0; n <= threads; ++n) {
+		struct archive* disk = archive_write_disk_new();
+		archive_write_disk_set_options(disk, flags);
+		archive_write_disk_set_standard_lookup(disk);
+		context.disks.push_back(disk);
+	}
+
+	struct archive* disk = context.disks[0];
+#ifndef NDEBUG
+	unsigned int unchanged = 0;
+#endif
+	{
+		thread_pool pool(threads, threads * 4);
+
+		for (i = 0; archive_read_next_header(archive, &entry) ==
+		     ARCHIVE_OK; ++i) {
+			string archive_filename = archive_entry_pathname(entry);
+			string reject_dir = trim_filename(absroot + string("/") + string(PKG_REJECTED));
+			string original_filename = trim_filename(absroot + string("/") + archive_filename);
+			string real_filename = original_filename;
+			mode_t mode = archive_entry_mode(entry);
+
+			// Check if file is filtered out via INSTALL
+			if (non_install_list.find(archive_filename) != non_install_list.end()) {
+				pthread_mutex_lock(&context.output);
+				cout << utilname << ": ignoring " << archive_filename << endl;
+				pthread_mutex_unlock(&context.output);
+
+				if (S_ISREG(mode))
+					archive_read_data_skip(archive);
+
+				continue;
+			}
+
+			// Check if file should be rejected
+			if (keep_list.find(archive_filename) != keep_list.end() && file_exists(real_filename))
+				real_filename = trim_filename(reject_dir + string("/") + archive_filename);
+
+			archive_entry_set_pathname(entry, const_cast<char*>
+			                           (real_filename.c_str()));
+
+			// Hardlink targets are relative to the root as well
+			if (archive_entry_hardlink(entry)) {
+				const string target = trim_filename(absroot + string("/") + archive_entry_hardlink(entry));
+				archive_entry_copy_hardlink(entry, target.c_str());
+			}
+
+			// Read small regular files ahead, to hand them to a worker
+			// or to find that an upgrade does not change them
+			const off_t size = archive_entry_size(entry);
+			file_sums_t::const_iterator installed = installed_sums.find(archive_filename);
+			if (installed != installed_sums.end() && installed->second.size != size)
+				installed = installed_sums.end();
+			if ((threads || installed != installed_sums.end()) && S_ISREG(mode) && !archive_entry_hardlink(entry) &&
+			    real_filename == original_filename && size <= INSTALL_BUFFER_MAX) {
+				install_job* job = new install_job(context, archive_filename, entry);
+				job->data.resize(size);
+				ssize_t length = size ? archive_read_data(archive, &job->data[0], size) : 0;
+				if (length != size) {
+					pthread_mutex_lock(&context.output);
+					cerr << utilname << ": could not install " + archive_filename << ": "
+					     << (length < 0 ? archive_error_string(archive) : "truncated archive") << endl;
+					pthread_mutex_unlock(&context.output);
+					delete job;
+					continue;
+				}
+				if (installed != installed_sums.end() &&
+				    keep_unchanged(disk, entry, real_filename, installed->second, job->data)) {
+					pthread_mutex_lock(&context.output);
+					sums[archive_filename] = installed->second;
+					sums[archive_filename].mtime = archive_entry_mtime(entry);
+					pthread_mutex_unlock(&context.output);
+#ifndef NDEBUG
+					++unchanged;
+#endif
+					delete job;
+					continue;
+				}
+				pool.add(job);
+				continue;
+			}
+
+			// Hardlinks need their target to be complete
+			if (archive_entry_hardlink(entry))
+				pool.wait();
+
+			// Extract file
+			string error;
+			xxh64 hash;
+			const bool hashed = S_ISREG(mode) && !archive_entry_hardlink(entry);
+			if (write_entry(disk, entry, archive, 0, 0, hashed ? &hash : 0, error) != ARCHIVE_OK) {
+				// If a file fails to install we just print an error message and
+				// continue trying to install the rest of the package.
+				pthread_mutex_lock(&context.output);
+				cerr << utilname << ": could not install " + archive_filename << ": " << error << endl;
+				pthread_mutex_unlock(&context.output);
+				continue;
+			}
+
+			if (hashed && real_filename == original_filename) {
+				pthread_mutex_lock(&context.output);
+				add_sum(sums, archive_filename, hash, archive_entry_size(entry), archive_entry_mtime(entry));
+				pthread_mutex_unlock(&context.output);
+			}
+
+			// Check rejected file
+			if (real_filename != original_filename) {
+				bool remove_file = false;
+
+				// Directory
+				if (S_ISDIR(mode))
+					remove_file = permissions_equal(real_filename, original_filename);
+				// Other files, the existing version is not read again
+				// when it is unchanged since it was installed
+				else if (permissions_equal(real_filename, original_filename)) {
+					file_sums_t::const_iterator sum = installed_sums.find(archive_filename);
+					struct stat buf;
+					if (hashed && sum != installed_sums.end() && !lstat_counted(original_filename.c_str(), &buf) && S_ISREG(buf.st_mode) &&
+					    buf.st_size == sum->second.size && buf.st_mtime == sum->second.mtime)
+						remove_file = size == 0 || (size == sum->second.size && hash.digest() == sum->second.hash);
+					else
+						remove_file = file_empty(real_filename) || file_equal(real_filename, original_filename);
+				}
+
+				// Remove rejected file or signal about its existence
+				if (remove_file) {
+					// The existing version has the same contents,
+					// unless only the rejected version was empty
+					struct stat buf;
+					if (hashed && !lstat_counted(original_filename.c_str(), &buf) && S_ISREG(buf.st_mode) && buf.st_size == size) {
+						pthread_mutex_lock(&context.output);
+						add_sum(sums, archive_filename, hash, buf.st_size, buf.st_mtime);
+						pthread_mutex_unlock(&context.output);
+					}
+					file_remove(reject_dir, real_filename);
+				} else {
+					pthread_mutex_lock(&context.output);
+					cout << utilname << ": rejecting " << archive_filename << ", keeping existing version" << endl;
+					pthread_mutex_unlock(&context.output);
+				}
+			}
+		}
+	}
+
+	// Directory times and permissions are restored when the disk
+	// writers are closed, which must happen after every file is written
+	for (vector<struct archive*>::reverse_iterator d = context.disks.rbegin(); d != context.disks.rend(); ++d)
+		archive_write_finish(*d);
+	pthread_mutex_destroy(&context.output);
+
+#ifndef NDEBUG
+	cerr << unchanged << " unchanged files left in place" << endl;
+#endif
+
+	if (i == 0) {
+		if (archive_errno(archive) == 0)
+			throw runtime_error("empty package");
+		else
+			throw runtime_error("could not read " + filename);
+	}
+
+	count_inflated(archive, filename);
+}
+
+void pkgutil::read_library_dirs(const string& filename, int depth)
+{
+	ifstream in((root + filename).c_str());
+	string line;
+
+	while (getline(in, line)) {
+		string::size_type comment = line.find('#');
+		if (comment != string::npos)
+			line.erase(comment);
+
+		istringstream words(line);
+		string word;
+		if (!(words >> word))
+			continue;
+
+		if (word == "include") {
+			if (depth > 8)
+				continue;
+			// Relative patterns are relative to the including file
+			while (words >> word) {
+				if (word[0] != '/')
+					word = filename.substr(0, filename.rfind('/') + 1) + word;
+				glob_t found;
+				if (glob((root + word).c_str(), 0, 0, &found) == 0) {
+					for (size_t i = 0; i < found.gl_pathc; ++i)
+						read_library_dirs(string(found.gl_pathv[i]).substr(root.length()), depth + 1);
+				}
+				globfree(&found);
+			}
+			continue;
+		}
+
+		// Directories may be separated by commas and carry a type
+		for (string::size_type begin = 0; begin < line.length();) {
+			string::size_type end = line.find_first_of(" \t,:", begin);
+			if (end == string::npos)
+				end = line.length();
+			string dir = line.substr(begin, end - begin);
+			begin = end + 1;
+
+			string::size_type type = dir.find('=');
+			if (type != string::npos)
+				dir.erase(type);
+			string::size_type start = dir.find_first_not_of('/');
+			if (start == string::npos)
+				continue;
+			dir.erase(0, start);
+			if (dir[dir.length() - 1] != '/')
+				dir += '/';
+			library_dirs.insert(dir);
+		}
+	}
+}
+
+void pkgutil::ldconfig_trigger(const set<string>& files)
+{
+	if (ldconfig_triggered)
+		return;
+
+	for (set<string>::const_iterator i = files.begin(); !ldconfig_triggered && i != files.end(); ++i)
+		ldconfig_check(*i);
+}
+
+void pkgutil::ldconfig_trigger(const file_list& files)
+{
+	if (ldconfig_triggered)
+		return;
+
+	for (file_list::const_iterator i = files.begin(); !ldconfig_triggered && i != files.end(); ++i)
+		ldconfig_check(*i);
+}
+
+void pkgutil::ldconfig_check(const string& file)
+{
+	if (!library_dirs_read) {
+		library_dirs.insert("lib/");
+		library_dirs.insert("lib64/");
+		library_dirs.insert("usr/lib/");
+		library_dirs.insert("usr/lib64/");
+		read_library_dirs(LDCONFIG_CONF, 0);
+		library_dirs_read = true;
+	}
+
+	// Shared objects in the library directories, and the configuration
+	if (file.compare(0, strlen(LDCONFIG_CONF) - 1, LDCONFIG_CONF + 1) == 0) {
+		ldconfig_triggered = true;
+		return;
+	}
+
+	string::size_type slash = file.rfind('/');
+	if (slash == file.length() - 1 || file.find(".so", slash == string::npos ? 0 : slash) == string::npos)
+		return;
+	if (library_dirs.find(file.substr(0, slash + 1)) != library_dirs.end())
+		ldconfig_triggered = true;
+}
+
+void pkgutil::ldconfig() const
+{
+	pkg_stats::phase phase("ldconfig");
+
+	// Deferred runs are merged until a run that is not deferred
+	const string trigger = root + PKG_LDCONFIG;
+	if (defer_ldconfig) {
+		if (ldconfig_triggered) {
+			int fd = creat(trigger.c_str(), 0444);
+			if (fd == -1)
+				throw runtime_error_with_errno("could not create " + trigger);
+			close(fd);
+		}
+		return;
+	}
+
+	bool deferred = file_exists(trigger);
+	if (!ldconfig_triggered && !deferred)
+		return;
+
+	// Only execute ldconfig if /etc/ld.so.conf exists
+	if (file_exists(root + LDCONFIG_CONF)) {
+		pid_t pid = fork();
+
+		if (pid == -1)
+			throw runtime_error_with_errno("fork() failed");
+
+		if (pid == 0) {
+			execl(LDCONFIG, LDCONFIG, "-r", root.c_str(), (char *) 0);
+			const char* msg = strerror(errno);
+			cerr << utilname << ": could not execute " << LDCONFIG << ": " << msg << endl;
+			exit(EXIT_FAILURE);
+		} else {
+			if (waitpid(pid, 0, 0) == -1)
+				throw runtime_error_with_errno("waitpid() failed");
+		}
+	}
+
+	if (deferred && unlink(trigger.c_str()) == -1 && errno != ENOENT)
+		throw runtime_error_with_errno("could not remove " + trigger);
+}
+
+void pkgutil::pkg_footprint(string& filename) const
+{
+	pkg_stats::phase phase("pkg_footprint");
+
+	// A valid manifest saves us from inflating the package at all,
+	// otherwise the archive is read once and the entries are kept
+	manifest_t manifest;
+	if (!pkg_read_manifest(filename, manifest))
+		pkg_scan(filename, manifest);
+
+	// Hardlinks are printed with the modes of their targets
+	map<string, mode_t> hardlink_target_modes;
+	for (manifest_t::const_iterator i = manifest.begin(); i != manifest.end(); ++i)
+		if (i->hardlink.empty())
+			hardlink_target_modes[i->path] = i->mode;
+
+	for (manifest_t::const_iterator i = manifest.begin(); i != manifest.end(); ++i)
+		print_footprint_entry(*i, hardlink_target_modes);
+}
+
+void pkgutil::print_footprint_entry(const entry_t& entry, const map<string, mode_t>& hardlink_target_modes) const
+{
+	// Access permissions
+	if (S_ISLNK(entry.mode)) {
+		// Access permissions on symlinks differ among filesystems, e.g. XFS and ext2 have different.
+		// To avoid getting different footprints we always use "lrwxrwxrwx".
+		cout << "lrwxrwxrwx";
+	} else if (!entry.hardlink.empty()) {
+		map<string, mode_t>::const_iterator target = hardlink_target_modes.find(entry.hardlink);
+		cout << mtos(target != hardlink_target_modes.end() ? target->second : 0);
+	} else {
+		cout << mtos(entry.mode);
+	}
+
+	cout << '\t';
+
+	// User
+	map<uid_t, string>::iterator user = user_names.find(entry.uid);
+	if (user == user_names.end()) {
+		struct passwd* pw = getpwuid(entry.uid);
+		user = user_names.insert(make_pair(entry.uid, pw ? string(pw->pw_name) : itos(entry.uid))).first;
+	}
+	cout << user->second;
+
+	cout << '/';
+
+	// Group
+	map<gid_t, string>::iterator group = group_names.find(entry.gid);
+	if (group == group_names.end()) {
+		struct group* gr = getgrgid(entry.gid);
+		group = group_names.insert(make_pair(entry.gid, gr ? string(gr->gr_name) : itos(entry.gid))).first;
+	}
+	cout << group->second;
+
+	// Filename
+	cout << '\t' << entry.path;
+
+	// Special cases
+	if (S_ISLNK(entry.mode)) {
+		// Symlink
+		cout << " -> " << entry.symlink;
+	} else if (S_ISCHR(entry.mode) ||
+	           S_ISBLK(entry.mode)) {
+		// Device
+		cout << " (" << entry.rdevmajor
+		     << ", " << entry.rdevminor
+		     << ")";
+	} else if (S_ISREG(entry.mode) &&
+	           entry.size == 0) {
+		// Empty regular file
+		cout << " (EMPTY)";
+	}
+
+	cout << '\n';
+}
+
+void pkgutil::pkg_scan(const string& filename, manifest_t& manifest) const
+{
+	unsigned int i;
+	struct archive* archive;
+	struct archive_entry* entry;
+
+	archive = archive_read_new();
+	archive_guard reader(archive, archive_read_finish);
+	INIT_ARCHIVE(archive);
+
+	if (open_package(archive, filename, jobs) != ARCHIVE_OK)
+		throw runtime_error_with_errno("could not open " + filename, archive_errno(archive));
+
+	for (i = 0; archive_read_next_header(archive, &entry) ==
+	     ARCHIVE_OK; ++i) {
+		manifest.push_back(entry_t());
+		read_entry(entry, manifest.back());
+
+		if (S_ISREG(manifest.back().mode) && archive_read_data_skip(archive))
+			throw runtime_error_with_errno("could not read " + filename, archive_errno(archive));
+	}
+
+	if (i == 0) {
+		if (archive_errno(archive) == 0)
+			throw runtime_error("empty package");
+		else
+			throw runtime_error("could not read " + filename);
+	}
+
+	count_inflated(archive, filename);
+}
+
+void pkgutil::pkg_manifest(const string& filename) const
+{
+	pkg_stats::phase phase("pkg_manifest");
+
+	struct stat buf;
+	if (stat(filename.c_str(), &buf) == -1)
+		throw runtime_error_with_errno("could not stat " + filename);
+
+	manifest_t manifest;
+	pkg_scan(filename, manifest);
+
+	cout << MANIFEST_MAGIC << ' ' << MANIFEST_VERSION << ' '
+	     << buf.st_size << ' ' << buf.st_mtime << '\n';
+
+	for (manifest_t::const_iterator i = manifest.begin(); i != manifest.end(); ++i) {
+		const string fields = i->path + i->symlink + i->hardlink;
+		if (fields.find_first_of("\t\n") != string::npos)
+			throw runtime_error("could not write manifest for " + filename + ": unsupported file name " + i->path);
+
+		cout << oct << i->mode << dec << '\t'
+		     << i->uid << '\t'
+		     << i->gid << '\t'
+		     << i->size << '\t'
+		     << i->mtime << '\t'
+		     << i->rdevmajor << '\t'
+		     << i->rdevminor << '\t'
+		     << i->path << '\t'
+		     << i->symlink << '\t'
+		     << i->hardlink << '\n';
+	}
+}
+
+bool pkgutil::pkg_read_manifest(const string& filename, manifest_t& manifest) const
+{
+	const string manifest_filename = filename + PKG_MANIFEST_EXT;
+
+	struct stat pkg_stat;
+	if (stat(filename.c_str(), &pkg_stat) == -1)
+		return false;
+
+	int fd = open(manifest_filename.c_str(), O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	string data;
+	struct stat buf;
+	if (fstat(fd, &buf) == 0) {
+		data.resize(buf.st_size);
+		ssize_t len = data.empty() ? 0 : read(fd, &data[0], data.size());
+		if (len != (ssize_t)data.size())
+			data.clear();
+	}
+	close(fd);
+
+	// Header, the manifest is stale unless it was made for
+	// a package of exactly this size and modification time
+	string::size_type pos = data.find('\n');
+	if (pos == string::npos)
+		return false;
+
+	char magic[32];
+	unsigned int version;
+	long long size;
+	long long mtime;
+	if (sscanf(data.substr(0, pos).c_str(), "%31s %u %lld %lld", magic, &version, &size, &mtime) != 4 ||
+	    strcmp(magic, MANIFEST_MAGIC) || version != MANIFEST_VERSION ||
+	    size != (long long)pkg_stat.st_size || mtime != (long long)pkg_stat.st_mtime)
+		return false;
+
+	// Entries
+	manifest_t result;
+	for (++pos; pos < data.size(); ) {
+		string::size_type end = data.find('\n', pos);
+		if (end == string::npos)
+			return false;
+
+		vector<string> fields;
+		for (string::size_type field = pos; field <= end; ) {
+			string::size_type next = data.find_first_of("\t\n", field);
+			fields.push_back(data.substr(field, next - field));
+			field = next + 1;
+		}
+		pos = end + 1;
+
+		if (fields.size() != 10 || fields[7].empty())
+			return false;
+
+		entry_t entry;
+		char* tail;
+		entry.mode = strtoul(fields[0].c_str(), &tail, 8);
+		entry.uid = strtoul(fields[1].c_str(), &tail, 10);
+		entry.gid = strtoul(fields[2].c_str(), &tail, 10);
+		entry.size = strtoll(fields[3].c_str(), &tail, 10);
+		entry.mtime = strtoll(fields[4].c_str(), &tail, 10);
+		entry.rdevmajor = strtoul(fields[5].c_str(), &tail, 10);
+		entry.rdevminor = strtoul(fields[6].c_str(), &tail, 10);
+		entry.path = fields[7];
+		entry.symlink = fields[8];
+		entry.hardlink = fields[9];
+		result.push_back(entry);
+	}
+
+	if (result.empty())
+		return false;
+
+	manifest.swap(result);
+	return true;
+}
+
+//
+// Member of a delta package made from a file of the base version, taken
+// over unchanged or patched. Its sums are those of the file in the base
+// and in the new version.
+//
+struct delta_member_t {
+	bool patch;
+	uint64_t base_hash;
+	uint64_t hash;
+	off_t size;
+	string base;
+};
+
+typedef map<string, delta_member_t> delta_index_t;
+
+static void run_zstd(const vector<string>& args)
+{
+	vector<char*> argv;
+	argv.push_back(const_cast<char*>(ZSTD_PATCH));
+	for (vector<string>::const_iterator i = args.begin(); i != args.end(); ++i)
+		argv.push_back(const_cast<char*>(i->c_str()));
+	argv.push_back(0);
+
+	pid_t pid = fork();
+	if (pid == -1)
+		throw runtime_error_with_errno("fork() failed");
+
+	if (pid == 0) {
+		execvp(ZSTD_PATCH, &argv[0]);
+		const char* msg = strerror(errno);
+		cerr << "could not execute " << ZSTD_PATCH << ": " << msg << endl;
+		_exit(EXIT_FAILURE);
+	}
+
+	int status;
+	if (waitpid(pid, &status, 0) == -1)
+		throw runtime_error_with_errno("waitpid() failed");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		throw runtime_error(ZSTD_PATCH " failed");
+}
+
+//
+// Reads the data of the current member of an archive, writing it to a
+// file and feeding it to a hash when they are given.
+//
+static void read_member(struct archive* archive, const string& filename, int fd, xxh64* hash)
+{
+	char buf[65536];
+	ssize_t length;
+
+	while ((length = archive_read_data(archive, buf, sizeof(buf))) > 0) {
+		if (hash)
+			hash->update(buf, length);
+		if (fd != -1 && write(fd, buf, length) != length)
+			throw runtime_error_with_errno("could not write member of " + filename);
+	}
+
+	if (length < 0)
+		throw runtime_error_with_errno("could not read " + filename, archive_errno(archive));
+}
+
+//
+// Writes a member to an archive, with the data taken from a file or the
+// current member of the source archive, or without data.
+//
+static void write_member(struct archive* out, struct archive_entry* entry, const string& filename,
+                         int fd, struct archive* source)
+{
+	if (archive_write_header(out, entry) != ARCHIVE_OK)
+		throw runtime_error("could not write " + filename + ": " + archive_error_string(out));
+
+	char buf[65536];
+	ssize_t length;
+	if (fd != -1) {
+		while ((length = read(fd, buf, sizeof(buf))) > 0)
+			if (archive_write_data(out, buf, length) != length)
+				throw runtime_error("could not write " + filename + ": " + archive_error_string(out));
+		if (length == -1)
+			throw runtime_error_with_errno("could not write " + filename);
+	} else if (source && S_ISREG(archive_entry_mode(entry))) {
+		while ((length = archive_read_data(source, buf, sizeof(buf))) > 0)
+			if (archive_write_data(out, buf, length) != length)
+				throw runtime_error("could not write " + filename + ": " + archive_error_string(out));
+		if (length < 0)
+			throw runtime_error(string("could not read package: ") + archive_error_string(source));
+	}
+}
+
+static int open_scratch(const string& filename, int flags)
+{
+	int fd = open(filename.c_str(), flags);
+	if (fd == -1)
+		throw runtime_error_with_errno("could not open " + (filename.empty() ? string("scratch file") : filename));
+	return fd;
+}
+
+//
+// Writes a delta package from base to filename to standard output. Every
+// member of the new version is in the delta, in its order. Regular files
+// that are also in the base version are empty when they are unchanged and
+// hold a zstd patch against the base version otherwise. The index in
+// front names the versions and has the sums pkgadd checks the installed
+// files and the patched ones against.
+//
+void pkgutil::pkg_delta(const string& base, const string& filename) const
+{
+	pkg_stats::phase phase("pkg_delta");
+
+	pair<string, pkginfo_t> from;
+	pair<string, pkginfo_t> to;
+	package_name(base, from);
+	package_name(filename, to);
+	if (from.first != to.first)
+		throw runtime_error(base + " and " + filename + " are not versions of the same package");
+
+	const string::size_type slash = filename.rfind('/');
+	pkg_stage stage(slash == string::npos ? string(".") : filename.substr(0, slash), utilname);
+	delta_index_t index;
+	struct archive* archive;
+	struct archive_entry* entry;
+
+	// Sums of the regular files of the new version
+	archive = archive_read_new();
+	archive_guard reader(archive, archive_read_finish);
+	INIT_ARCHIVE(archive);
+	if (open_package(archive, filename, jobs) != ARCHIVE_OK)
+		throw runtime_error_with_errno("could not open " + filename, archive_errno(archive));
+
+	while (archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
+		if (!S_ISREG(archive_entry_mode(entry)) || archive_entry_hardlink(entry))
+			continue;
+
+		xxh64 hash;
+		read_member(archive, filename, -1, &hash);
+		delta_member_t& member = index[archive_entry_pathname(entry)];
+		member.patch = false;
+		member.base_hash = 0;
+		member.hash = hash.digest();
+		member.size = archive_entry_size(entry);
+	}
+
+	// Copies of the files of the base version that changed, kept until
+	// the patches against them are made
+	set<string> derived;
+	archive = archive_read_new();
+	reader.reset(archive);
+	INIT_ARCHIVE(archive);
+	if (open_package(archive, base, jobs) != ARCHIVE_OK)
+		throw runtime_error_with_errno("could not open " + base, archive_errno(archive));
+
+	while (archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
+		delta_index_t::iterator member = index.find(archive_entry_pathname(entry));
+		if (member == index.end() || !S_ISREG(archive_entry_mode(entry)) || archive_entry_hardlink(entry))
+			continue;
+
+		xxh64 hash;
+		member->second.base = stage.create();
+		int fd = open_scratch(member->second.base, O_WRONLY | O_TRUNC);
+		read_member(archive, base, fd, &hash);
+		close(fd);
+
+		member->second.base_hash = hash.digest();
+		member->second.patch = member->second.base_hash != member->second.hash ||
+		                       archive_entry_size(entry) != member->second.size;
+		if (!member->second.patch)
+			stage.remove(member->second.base);
+		derived.insert(member->first);
+	}
+	reader.finish();
+
+	for (delta_index_t::iterator i = index.begin(); i != index.end();) {
+		if (derived.find(i->first) == derived.end())
+			index.erase(i++);
+		else
+			++i;
+	}
+
+	ostringstream text;
+	text << DELTA_MAGIC << ' ' << DELTA_VERSION << '\n'
+	     << to.first << '\n'
+	     << from.second.version << '\n'
+	     << to.second.version << '\n';
+	for (delta_index_t::const_iterator i = index.begin(); i != index.end(); ++i) {
+		if (i->first.find('\n') != string::npos)
+			throw runtime_error("could not write delta for " + filename + ": unsupported file name " + i->first);
+
+		char sums[64];
+		snprintf(sums, sizeof(sums), "%016llx %016llx %lld ", (unsigned long long)i->second.base_hash,
+		         (unsigned long long)i->second.hash, (long long)i->second.size);
+		text << (i->second.patch ? "patch " : "copy ") << sums << i->first << '\n';
+	}
+
+	// Index, followed by the members of the new version
+	struct archive* delta = archive_write_new();
+	archive_guard writer(delta, archive_write_finish);
+	archive_write_set_compression_gzip(delta);
+	archive_write_set_format_pax_restricted(delta);
+	archive_write_set_bytes_in_last_block(delta, 1);
+	if (archive_write_open_fd(delta, STDOUT_FILENO) != ARCHIVE_OK)
+		throw runtime_error(string("could not write delta: ") + archive_error_string(delta));
+
+	const string index_text = text.str();
+	entry = archive_entry_new();
+	archive_entry_set_pathname(entry, DELTA_INDEX);
+	archive_entry_set_mode(entry, S_IFREG | 0644);
+	archive_entry_set_size(entry, index_text.size());
+	archive_entry_set_mtime(entry, time(0), 0);
+	if (archive_write_header(delta, entry) != ARCHIVE_OK ||
+	    archive_write_data(delta, index_text.data(), index_text.size()) != (ssize_t)index_text.size())
+		throw runtime_error(string("could not write delta: ") + archive_error_string(delta));
+	archive_entry_free(entry);
+
+	archive = archive_read_new();
+	reader.reset(archive);
+	INIT_ARCHIVE(archive);
+	if (open_package(archive, filename, jobs) != ARCHIVE_OK)
+		throw runtime_error_with_errno("could not open " + filename, archive_errno(archive));
+
+	while (archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
+		delta_index_t::const_iterator member = index.end();
+		if (S_ISREG(archive_entry_mode(entry)) && !archive_entry_hardlink(entry))
+			member = index.find(archive_entry_pathname(entry));
+
+		if (member == index.end()) {
+			write_member(delta, entry, "delta", -1, archive);
+			continue;
+		}
+
+		struct archive_entry* derived_entry = archive_entry_clone(entry);
+		if (!member->second.patch) {
+			archive_entry_set_size(derived_entry, 0);
+			write_member(delta, derived_entry, "delta", -1, 0);
+		} else {
+			const string target = stage.create();
+			const string patch = stage.create();
+			int fd = open_scratch(target, O_WRONLY | O_TRUNC);
+			read_member(archive, filename, fd, 0);
+			close(fd);
+
+			vector<string> args;
+			args.push_back("-q");
+			args.push_back("-f");
+			args.push_back("-19");
+			args.push_back("--long=31");
+			args.push_back("--patch-from=" + member->second.base);
+			args.push_back("-o");
+			args.push_back(patch);
+			args.push_back(target);
+			run_zstd(args);
+
+			struct stat buf;
+			fd = open_scratch(patch, O_RDONLY);
+			if (fstat(fd, &buf) == -1)
+				throw runtime_error_with_errno("could not stat " + patch);
+			archive_entry_set_size(derived_entry, buf.st_size);
+			write_member(delta, derived_entry, "delta", fd, 0);
+			close(fd);
+
+			stage.remove(target);
+			stage.remove(patch);
+			stage.remove(member->second.base);
+		}
+		archive_entry_free(derived_entry);
+	}
+	reader.finish();
+
+	if (archive_write_close(delta) != ARCHIVE_OK)
+		throw runtime_error(string("could not write delta: ") + archive_error_string(delta));
+}
+
+//
+// Rebuilds the package a delta was made for from the installed files of
+// its base version, writing it uncompressed to staged like pkg_open.
+// Fails unless the base version is installed and every file the delta
+// takes from it has the contents the delta was made against.
+//
+pair<string, pkgutil::pkginfo_t> pkgutil::pkg_open_delta(const string& filename, pkg_stage& stage, const string& staged)
+{
+	pkg_stats::phase phase("pkg_open_delta");
+	return pkg_read_delta(filename, stage, staged, true);
+}
+
+void pkgutil::pkg_rebuild_delta(const string& filename, pkg_stage& stage, const string& staged)
+{
+	pkg_stats::phase phase("pkg_rebuild_delta");
+	pkg_read_delta(filename, stage, staged, false);
+}
+
+//
+// Reads a delta package, checking that the files it was made against
+// are installed. Without a file to stage to, the delta is only checked
+// and its member list returned. The installed version is compared to the
+// base only when check_version is set, a delta rebuilt after its checked
+// member list was committed to the database finds the new version there.
+//
+pair<string, pkgutil::pkginfo_t> pkgutil::pkg_read_delta(const string& filename, pkg_stage& stage, const string& staged, bool check_version)
+{
+	pair<string, pkginfo_t> result;
+	struct archive* archive;
+	struct archive_entry* entry;
+
+	archive = archive_read_new();
+	archive_guard reader(archive, archive_read_finish);
+	INIT_ARCHIVE(archive);
+	if (open_package(archive, filename, jobs) != ARCHIVE_OK)
+		throw runtime_error_with_errno("could not open " + filename, archive_errno(archive));
+
+	// Index
+	if (archive_read_next_header(archive, &entry) != ARCHIVE_OK || string(archive_entry_pathname(entry)) != DELTA_INDEX)
+		throw runtime_error(filename + " is not a delta package");
+
+	string text;
+	char buf[65536];
+	ssize_t length;
+	while ((length = archive_read_data(archive, buf, sizeof(buf))) > 0)
+		text.append(buf, length);
+	if (length < 0)
+		throw runtime_error_with_errno("could not read " + filename, archive_errno(archive));
+
+	istringstream in(text);
+	string magic;
+	unsigned int format = 0;
+	string base;
+	in >> magic >> format;
+	in.ignore(1);
+	if (magic != DELTA_MAGIC || format != DELTA_VERSION ||
+	    !getline(in, result.first) || !getline(in, base) || !getline(in, result.second.version))
+		throw runtime_error(filename + ": unsupported delta package");
+
+	delta_index_t index;
+	for (string line; getline(in, line);) {
+		delta_member_t member;
+		unsigned long long base_hash, hash;
+		long long size;
+		int path = 0;
+		string::size_type op = line.find(' ');
+		if (op == string::npos ||
+		    sscanf(line.c_str() + op + 1, "%16llx %16llx %lld %n", &base_hash, &hash, &size, &path) < 3 || path <= 0)
+			throw runtime_error(filename + ": invalid delta entry");
+		member.patch = line.compare(0, op, "patch") == 0;
+		member.base_hash = base_hash;
+		member.hash = hash;
+		member.size = size;
+		index[line.substr(op + 1 + path)] = member;
+	}
+
+	if (check_version && (!db_find_pkg(result.first) || packages[result.first].version != base))
+		throw runtime_error(filename + " requires " + result.first + " " + base + " to be installed");
+
+	// Members of the new version
+	struct archive* out = 0;
+	archive_guard writer(0, archive_write_finish);
+	if (!staged.empty()) {
+		out = archive_write_new();
+		writer.reset(out);
+		archive_write_set_compression_none(out);
+		archive_write_set_format_pax_restricted(out);
+		if (archive_write_open_filename(out, staged.c_str()) != ARCHIVE_OK)
+			throw runtime_error(string("could not write ") + staged + ": " + archive_error_string(out));
+	}
+
+	while (archive_read_next_header(archive, &entry) == ARCHIVE_OK) {
+		const string path = archive_entry_pathname(entry);
+		result.second.files.append(path.c_str());
+
+		delta_index_t::const_iterator member = index.end();
+		if (S_ISREG(archive_entry_mode(entry)) && !archive_entry_hardlink(entry))
+			member = index.find(path);
+
+		if (member == index.end()) {
+			if (out)
+				write_member(out, entry, staged, -1, archive);
+			continue;
+		}
+
+		const string base_filename = root + path;
+		uint64_t hash;
+		int fd = open(base_filename.c_str(), O_RDONLY);
+		bool matches = fd != -1 && file_hash(fd, hash) && hash == member->second.base_hash;
+		if (fd != -1)
+			close(fd);
+		if (!matches)
+			throw runtime_error(base_filename + " differs from the file " + filename + " was made against");
+		if (!out)
+			continue;
+
+		string patched;
+		if (member->second.patch) {
+			const string patch = stage.create();
+			patched = stage.create();
+			fd = open_scratch(patch, O_WRONLY | O_TRUNC);
+			read_member(archive, filename, fd, 0);
+			close(fd);
+
+			vector<string> args;
+			args.push_back("-d");
+			args.push_back("-q");
+			args.push_back("-f");
+			args.push_back("--long=31");
+			args.push_back("--patch-from=" + base_filename);
+			args.push_back("-o");
+			args.push_back(patched);
+			args.push_back(patch);
+			run_zstd(args);
+			stage.remove(patch);
+		}
+
+		// The result must be the file the delta was made for
+		const string& source = patched.empty() ? base_filename : patched;
+		struct stat st;
+		fd = open_scratch(source, O_RDONLY);
+		if (fstat(fd, &st) == -1 || st.st_size != member->second.size ||
+		    !file_hash(fd, hash) || hash != member->second.hash || lseek(fd, 0, SEEK_SET) == -1) {
+			close(fd);
+			throw runtime_error("could not rebuild " + path + " from " + filename);
+		}
+
+		struct archive_entry* rebuilt = archive_entry_clone(entry);
+		archive_entry_set_size(rebuilt, st.st_size);
+		write_member(out, rebuilt, staged, fd, 0);
+		archive_entry_free(rebuilt);
+		close(fd);
+
+		if (!patched.empty())
+			stage.remove(patched);
+	}
+	reader.finish();
+
+	if (out && archive_write_close(out) != ARCHIVE_OK)
+		throw runtime_error(string("could not write ") + staged + ": " + archive_error_string(out));
+
+	if (result.second.files.empty())
+		throw runtime_error("empty package");
+
+	result.second.files.sort();
+	return result;
+}
+
+void pkgutil::print_version() const
+{
+	cout << utilname << " (pkgutils) " << VERSION << endl;
+}
+
+path_pool file_list::pool;
+
+path_pool::~path_pool()
+{
+	for (vector<char*>::iterator i = blocks.begin(); i != blocks.end(); ++i)
+		delete[] *i;
+}
+
+path_pool::id_t path_pool::intern(const char* path, size_t length)
+{
+	// Keep the table at most half full
+	if ((paths.size() + 1) * 2 > buckets.size())
+		rehash(buckets.empty() ? 4096 : buckets.size() * 2);
+
+	// Eight bytes at a time, folded down at the end
+	uint64_t h = length * 0x9e3779b97f4a7c15ULL;
+	size_t i = 0;
+	for (uint64_t word; i + 8 <= length; i += 8) {
+		memcpy(&word, path + i, 8);
+		h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 32;
+	}
+	for (; i < length; ++i)
+		h = (h ^ (unsigned char)path[i]) * 0x100000001b3ULL;
+	const uint32_t hash = (h ^ (h >> 29)) * 0x9e3779b9U;
+
+	const size_t mask = buckets.size() - 1;
+	size_t bucket = hash & mask;
+	for (; buckets[bucket].id; bucket = (bucket + 1) & mask) {
+		const id_t id = buckets[bucket].id - 1;
+		if (buckets[bucket].hash == hash && !strncmp(paths[id], path, length) && !paths[id][length])
+			return id;
+	}
+
+	char* copy;
+	if (length + 1 > PATH_BLOCK_SIZE / 2) {
+		// Long paths get a block of their own
+		copy = new char[length + 1];
+		blocks.insert(blocks.begin(), copy);
+	} else {
+		if (length + 1 > PATH_BLOCK_SIZE - used) {
+			blocks.push_back(new char[PATH_BLOCK_SIZE]);
+			used = 0;
+		}
+		copy = blocks.back() + used;
+		used += length + 1;
+	}
+	memcpy(copy, path, length);
+	copy[length] = '\0';
+
+	const id_t id = paths.size();
+	paths.push_back(copy);
+	buckets[bucket].hash = hash;
+	buckets[bucket].id = id + 1;
+	return id;
+}
+
+void path_pool::rehash(size_t count)
+{
+	vector<bucket_t> old(count);
+	old.swap(buckets);
+	for (vector<bucket_t>::const_iterator i = old.begin(); i != old.end(); ++i) {
+		if (!i->id)
+			continue;
+		size_t bucket = i->hash & (count - 1);
+		while (buckets[bucket].id)
+			bucket = (bucket + 1) & (count - 1);
+		buckets[bucket] = *i;
+	}
+}
+
+file_list::const_iterator file_list::lower_bound(const char* path) const
+{
+	return const_iterator(std::lower_bound(ids.begin(), ids.end(), path, path_id_less));
+}
+
+file_list::const_iterator file_list::find(const char* path) const
+{
+	const_iterator i = lower_bound(path);
+	return i != end() && !strcmp(*i, path) ? i : end();
+}
+
+void file_list::insert(const char* path)
+{
+	// Paths mostly come in sorted order and are appended
+	vector<path_pool::id_t>::iterator i = ids.end();
+	if (!ids.empty() && strcmp(pool.str(ids.back()), path) >= 0) {
+		i = std::lower_bound(ids.begin(), ids.end(), path, path_id_less);
+		if (!strcmp(pool.str(*i), path))
+			return;
+	}
+	ids.insert(i, pool.intern(path, strlen(path)));
+}
+
+void file_list::erase(const string& path)
+{
+	const_iterator i = find(path);
+	if (i != end())
+		ids.erase(ids.begin() + (i.id() - ids.begin()));
+}
+
+void file_list::sort()
+{
+	// Lists written by pkgutils are sorted already
+	vector<path_pool::id_t>::const_iterator i = ids.begin();
+	while (i != ids.end() && i + 1 != ids.end() && path_id_order(*i, *(i + 1)))
+		++i;
+	if (i == ids.end() || i + 1 == ids.end())
+		return;
+
+	// Interned paths are equal when their ids are
+	std::sort(ids.begin(), ids.end(), path_id_order);
+	ids.erase(unique(ids.begin(), ids.end()), ids.end());
+}
+
+bool db_image::map(const string& filename)
+{
+	unmap();
+
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	struct stat buf;
+	if (fstat(fd, &buf) == -1 || buf.st_size < (off_t)sizeof(header_t)) {
+		close(fd);
+		return false;
+	}
+
+	void* addr = mmap(0, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return false;
+
+	data = static_cast<char*>(addr);
+	size = buf.st_size;
+
+	if (!check()) {
+		unmap();
+		return false;
+	}
+
+	return true;
+}
+
+void db_image::load(string& image)
+{
+	unmap();
+	buffer.swap(image);
+	data = &buffer[0];
+	size = buffer.size();
+
+	if (!check()) {
+		unmap();
+		throw runtime_error("corrupt package database image");
+	}
+}
+
+void db_image::unmap()
+{
+	if (data && buffer.empty())
+		munmap(data, size);
+
+	buffer.clear();
+	data = 0;
+	size = 0;
+}
+
+bool db_image::matches(const struct stat& db_stat) const
+{
+	const header_t* h = header();
+	return h->db_ino == (uint64_t)db_stat.st_ino &&
+		h->db_size == (uint64_t)db_stat.st_size &&
+		h->db_mtime == (int64_t)db_stat.st_mtim.tv_sec &&
+		h->db_mtime_nsec == (int64_t)db_stat.st_mtim.tv_nsec;
+}
+
+bool db_image::check() const
+{
+	// Reject foreign, stale and truncated images
+	const header_t* h = header();
+	bool valid = !memcmp(h->magic, DB_IMAGE_MAGIC, sizeof(h->magic)) &&
+		h->byte_order == DB_IMAGE_BYTE_ORDER &&
+		h->packages + (uint64_t)h->npackages * sizeof(package_t) <= size &&
+		h->files + (uint64_t)h->nfiles * sizeof(uint32_t) <= size &&
+		h->paths + (uint64_t)h->npaths * sizeof(path_t) <= size &&
+		h->owners + (uint64_t)h->nowners * sizeof(uint32_t) <= size &&
+		h->strings + (uint64_t)h->strings_size <= size &&
+		(h->strings_size == 0 || data[h->strings + h->strings_size - 1] == '\0');
+
+	for (uint32_t i = 0; valid && i < h->npackages; ++i) {
+		const package_t& p = pkg(i);
+		valid = p.name < h->strings_size && p.version < h->strings_size &&
+			p.files + (uint64_t)p.nfiles <= h->nfiles;
+	}
+
+	return valid;
+}
+
+const db_image::package_t& db_image::pkg(uint32_t index) const
+{
+	return reinterpret_cast<const package_t*>(data + header()->packages)[index];
+}
+
+const db_image::package_t* db_image::pkg_find(const string& name) const
+{
+	uint32_t low = 0;
+	uint32_t high = pkg_count();
+
+	while (low < high) {
+		uint32_t middle = low + (high - low) / 2;
+		int cmp = strcmp(str(pkg(middle).name), name.c_str());
+		if (cmp == 0)
+			return &pkg(middle);
+		else if (cmp < 0)
+			low = middle + 1;
+		else
+			high = middle;
 	}
 
-#ifndef NDEBUG
-	cerr << "Conflicts phase 2 (conflicts in filesystem added):" << endl;
-	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
-	cerr << endl;
-#endif
+	return 0;
+}
 
-	// Exclude directories
-	set<string> tmp = files;
-	for (set<string>::const_iterator i = tmp.begin(); i != tmp.end(); ++i) {
-		if ((*i)[i->length() - 1] == '/')
-			files.erase(*i);
-	}
+const uint32_t* db_image::pkg_files(const package_t& pkg) const
+{
+	return reinterpret_cast<const uint32_t*>(data + header()->files) + pkg.files;
+}
 
-#ifndef NDEBUG
-	cerr << "Conflicts phase 3 (directories excluded):" << endl;
-	copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
-	cerr << endl;
-#endif
+const db_image::path_t& db_image::path(uint32_t index) const
+{
+	return reinterpret_cast<const path_t*>(data + header()->paths)[index];
+}
 
-	// If this is an upgrade, remove files already owned by this package
-	if (packages.find(name) != packages.end()) {
-		for (set<string>::const_iterator i = packages[name].files.begin(); i != packages[name].files.end(); ++i)
-			files.erase(*i);
+uint32_t db_image::path_lower_bound(const char* name) const
+{
+	uint32_t low = 0;
+	uint32_t high = path_count();
 
-#ifndef NDEBUG
-		cerr << "Conflicts phase 4 (files already owned by this package excluded):" << endl;
-		copy(files.begin(), files.end(), ostream_iterator<string>(cerr, "\n"));
-		cerr << endl;
-#endif
+	while (low < high) {
+		uint32_t middle = low + (high - low) / 2;
+		if (strcmp(str(path(middle).path), name) < 0)
+			low = middle + 1;
+		else
+			high = middle;
 	}
 
-	return files;
+	return low;
 }
 
-pair<string, pkgutil::pkginfo_t> pkgutil::pkg_open(const string& filename) const
+const db_image::path_t* db_image::path_find(const string& name) const
 {
-	pair<string, pkginfo_t> result;
-	unsigned int i;
-	struct archive* archive;
-	struct archive_entry* entry;
+	uint32_t index = path_lower_bound(name.c_str());
+	if (index < path_count() && !strcmp(str(path(index).path), name.c_str()))
+		return &path(index);
 
-	// Extract name and version from filename
-	string basename(filename, filename.rfind('/') + 1);
-	string name(basename, 0, basename.find(VERSION_DELIM));
-	string version(basename, 0, basename.rfind(PKG_EXT));
-	version.erase(0, version.find(VERSION_DELIM) == string::npos ? string::npos : version.find(VERSION_DELIM) + 1);
-   
-	if (name.empty() || version.empty())
-		throw runtime_error("could not determine name and/or version of " + basename + ": Invalid package name");
+	return 0;
+}
 
-	result.first = name;
-	result.second.version = version;
+const uint32_t* db_image::path_owners(const path_t& path) const
+{
+	if (path.owners + (uint64_t)path.nowners > header()->nowners)
+		throw runtime_error("corrupt package database image");
 
-	archive = archive_read_new();
-	INIT_ARCHIVE(archive);
+	const uint32_t* owners = reinterpret_cast<const uint32_t*>(data + header()->owners) + path.owners;
+	for (uint32_t i = 0; i < path.nowners; ++i)
+		if (owners[i] >= header()->npackages)
+			throw runtime_error("corrupt package database image");
 
-	if (archive_read_open_filename(archive,
-	    const_cast<char*>(filename.c_str()),
-	    ARCHIVE_DEFAULT_BYTES_PER_BLOCK) != ARCHIVE_OK)
-		throw runtime_error_with_errno("could not open " + filename, archive_errno(archive));
+	return owners;
+}
 
-	for (i = 0; archive_read_next_header(archive, &entry) ==
-	     ARCHIVE_OK; ++i) {
+const char* db_image::str(uint32_t offset) const
+{
+	if (offset >= header()->strings_size)
+		throw runtime_error("corrupt package database image");
 
-		result.second.files.insert(result.second.files.end(),
-		                           archive_entry_pathname(entry));
+	return data + header()->strings + offset;
+}
 
-		mode_t mode = archive_entry_mode(entry);
+pkg_stage::pkg_stage(const string& dir, const string& prefix)
+	: dir(dir), prefix(prefix)
+{
+}
 
-		if (S_ISREG(mode) &&
-		    archive_read_data_skip(archive) != ARCHIVE_OK)
-			throw runtime_error_with_errno("could not read " + filename, archive_errno(archive));
-	}
-   
-	if (i == 0) {
-		if (archive_errno(archive) == 0)
-			throw runtime_error("empty package");
-		else
-			throw runtime_error("could not read " + filename);
-	}
+pkg_stage::~pkg_stage()
+{
+	for (vector<string>::const_iterator i = files.begin(); i != files.end(); ++i)
+		unlink(i->c_str());
+}
 
-	archive_read_finish(archive);
+string pkg_stage::create()
+{
+	string filename = dir + "/" + prefix + ".XXXXXX";
+	vector<char> buf(filename.begin(), filename.end());
+	buf.push_back('\0');
 
-	return result;
+	int fd = mkstemp(&buf[0]);
+	if (fd == -1)
+		return "";
+
+	close(fd);
+	files.push_back(&buf[0]);
+	return files.back();
 }
 
-void pkgutil::pkg_install(const string& filename, const set<string>& keep_list, const set<string>& non_install_list) const
+void pkg_stage::remove(const string& filename)
 {
-	struct archive* archive;
-	struct archive_entry* entry;
-	unsigned int i;
-	char buf[PATH_MAX];
-	string absroot;
+	vector<string>::iterator i = find(files.begin(), files.end(), filename);
+	if (i != files.end()) {
+		unlink(i->c_str());
+		files.erase(i);
+	}
+}
 
-	archive = archive_read_new();
-	INIT_ARCHIVE(archive);
+thread_pool::thread_pool(unsigned int n, unsigned int max)
+	: max_queued(max ? max : 1), busy(0), started(0), stopping(false)
+{
+	pthread_mutex_init(&mutex, 0);
+	pthread_cond_init(&work_cond, 0);
+	pthread_cond_init(&space_cond, 0);
+	pthread_cond_init(&idle_cond, 0);
+
+	// Carry on with fewer workers if threads can not be created,
+	// with none left every job simply runs in the calling thread
+	for (unsigned int i = 0; i < n; ++i) {
+		pthread_t thread;
+		if (pthread_create(&thread, 0, worker, this) != 0)
+			break;
+		threads.push_back(thread);
+	}
+}
 
-	if (archive_read_open_filename(archive,
-	    const_cast<char*>(filename.c_str()),
-	    ARCHIVE_DEFAULT_BYTES_PER_BLOCK) != ARCHIVE_OK)
-		throw runtime_error_with_errno("could not open " + filename, archive_errno(archive));
+thread_pool::~thread_pool()
+{
+	wait();
 
-	chdir(root.c_str());
-	absroot = getcwd(buf, sizeof(buf));
+	pthread_mutex_lock(&mutex);
+	stopping = true;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&mutex);
 
-	for (i = 0; archive_read_next_header(archive, &entry) ==
-	     ARCHIVE_OK; ++i) {
-		string archive_filename = archive_entry_pathname(entry);
-		string reject_dir = trim_filename(absroot + string("/") + string(PKG_REJECTED));
-		string original_filename = trim_filename(absroot + string("/") + archive_filename);
-		string real_filename = original_filename;
+	for (vector<pthread_t>::iterator i = threads.begin(); i != threads.end(); ++i)
+		pthread_join(*i, 0);
+
+	pthread_cond_destroy(&idle_cond);
+	pthread_cond_destroy(&space_cond);
+	pthread_cond_destroy(&work_cond);
+	pthread_mutex_destroy(&mutex);
+}
 
-		// Check if file is filtered out via INSTALL
-		if (non_install_list.find(archive_filename) != non_install_list.end()) {
-			mode_t mode;
+void thread_pool::add(job* j)
+{
+	if (threads.empty()) {
+		run_job(j, 0);
+		return;
+	}
 
-			cout << utilname << ": ignoring " << archive_filename << endl;
+	pthread_mutex_lock(&mutex);
+	while (queue.size() >= max_queued)
+		pthread_cond_wait(&space_cond, &mutex);
+	queue.push_back(j);
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&mutex);
+}
 
-			mode = archive_entry_mode(entry);
+void thread_pool::wait()
+{
+	pthread_mutex_lock(&mutex);
+	while (!queue.empty() || busy)
+		pthread_cond_wait(&idle_cond, &mutex);
+	pthread_mutex_unlock(&mutex);
+}
 
-			if (S_ISREG(mode))
-				archive_read_data_skip(archive);
+void* thread_pool::worker(void* arg)
+{
+	thread_pool* pool = static_cast<thread_pool*>(arg);
 
-			continue;
-		}
+	pthread_mutex_lock(&pool->mutex);
+	const unsigned int number = ++pool->started;
 
-		// Check if file should be rejected
-		if (file_exists(real_filename) && keep_list.find(archive_filename) != keep_list.end())
-			real_filename = trim_filename(reject_dir + string("/") + archive_filename);
+	for (;;) {
+		while (pool->queue.empty() && !pool->stopping)
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+		if (pool->queue.empty())
+			break;
 
-		archive_entry_set_pathname(entry, const_cast<char*>
-		                           (real_filename.c_str()));
+		job* j = pool->queue.front();
+		pool->queue.pop_front();
+		++pool->busy;
+		pthread_cond_signal(&pool->space_cond);
+		pthread_mutex_unlock(&pool->mutex);
 
-		// Extract file
-		unsigned int flags = ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_UNLINK;
+		run_job(j, number);
 
-		if (archive_read_extract(archive, entry, flags) != ARCHIVE_OK) {
-			// If a file fails to install we just print an error message and
-			// continue trying to install the rest of the package.
-			const char* msg = archive_error_string(archive);
-			cerr << utilname << ": could not install " + archive_filename << ": " << msg << endl;
-			continue;
-		}
+		pthread_mutex_lock(&pool->mutex);
+		if (--pool->busy == 0 && pool->queue.empty())
+			pthread_cond_broadcast(&pool->idle_cond);
+	}
 
-		// Check rejected file
-		if (real_filename != original_filename) {
-			bool remove_file = false;
-			mode_t mode = archive_entry_mode(entry);
+	pthread_mutex_unlock(&pool->mutex);
+	return 0;
+}
 
-			// Directory
-			if (S_ISDIR(mode))
-				remove_file = permissions_equal(real_filename, original_filename);
-			// Other files
-			else
-				remove_file = permissions_equal(real_filename, original_filename) &&
-					(file_empty(real_filename) || file_equal(real_filename, original_filename));
+void thread_pool::run_job(job* j, unsigned int worker)
+{
+	// Jobs report their own errors, anything escaping them must not
+	// take down the worker thread
+	try {
+		j->run(worker);
+	} catch (const exception& e) {
+		cerr << e.what() << endl;
+	}
+	delete j;
+}
 
-			// Remove rejected file or signal about its existence
-			if (remove_file)
-				file_remove(reject_dir, real_filename);
-			else
-				cout << utilname << ": rejecting " << archive_filename << ", keeping existing version" << endl;
-		}
+io_ring::io_ring(unsigned int n)
+	: fd(-1), failed(false), entries(0), queued(0), inflight(0),
+	  sq_map(MAP_FAILED), sq_map_size(0), cq_map(MAP_FAILED), cq_map_size(0), sqes(MAP_FAILED), sqes_size(0)
+{
+#ifdef HAVE_IO_URING
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	fd = syscall(__NR_io_uring_setup, n, &params);
+	if (fd == -1)
+		return;
+
+	// Both operations must be known to the kernel, or none are used
+	const size_t probe_size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	vector<char> probe_buffer(probe_size, 0);
+	struct io_uring_probe* probe = reinterpret_cast<struct io_uring_probe*>(&probe_buffer[0]);
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == -1 ||
+	    probe->last_op < IORING_OP_UNLINKAT ||
+	    !(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) ||
+	    !(probe->ops[IORING_OP_UNLINKAT].flags & IO_URING_OP_SUPPORTED)) {
+		close(fd);
+		fd = -1;
+		return;
 	}
 
-	if (i == 0) {
-		if (archive_errno(archive) == 0)
-			throw runtime_error("empty package");
-		else
-			throw runtime_error("could not read " + filename);
+	sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_map_size = cq_map_size = max(sq_map_size, cq_map_size);
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq_map = mmap(0, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq_map != MAP_FAILED && (params.features & IORING_FEAT_SINGLE_MMAP))
+		cq_map = sq_map;
+	else if (sq_map != MAP_FAILED)
+		cq_map = mmap(0, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if (cq_map != MAP_FAILED)
+		sqes = mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		failed = true;
+		return;
 	}
 
-	archive_read_finish(archive);
+	char* sq = static_cast<char*>(sq_map);
+	char* cq = static_cast<char*>(cq_map);
+	sq_tail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+	sq_mask = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+	cq_head = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+	cq_mask = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+	cqes = cq + params.cq_off.cqes;
+
+	entries = params.sq_entries;
+	statx_buffers.resize(entries * sizeof(struct statx));
+#else
+	(void)n;
+#endif
 }
 
-void pkgutil::ldconfig() const
+io_ring::~io_ring()
 {
-	// Only execute ldconfig if /etc/ld.so.conf exists
-	if (file_exists(root + LDCONFIG_CONF)) {
-		pid_t pid = fork();
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqes_size);
+	if (cq_map != MAP_FAILED && cq_map != sq_map)
+		munmap(cq_map, cq_map_size);
+	if (sq_map != MAP_FAILED)
+		munmap(sq_map, sq_map_size);
+	if (fd != -1)
+		close(fd);
+}
 
-		if (pid == -1)
-			throw runtime_error_with_errno("fork() failed");
+void* io_ring::next_entry(unsigned int& slot)
+{
+#ifdef HAVE_IO_URING
+	// Only as many operations are in flight as there are entries, so the
+	// completion queue can not overflow and an entry's slot in the
+	// submission queue also picks its statx buffer
+	if (queued + inflight == entries)
+		submit();
+
+	const unsigned int tail = *sq_tail;
+	slot = tail & *sq_mask;
+	sq_array[slot] = slot;
+
+	struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(sqes) + slot;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = done.size();
+	done.push_back(-ECANCELED);
+
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++queued;
+	return sqe;
+#else
+	(void)slot;
+	return 0;
+#endif
+}
 
-		if (pid == 0) {
-			execl(LDCONFIG, LDCONFIG, "-r", root.c_str(), (char *) 0);
-			const char* msg = strerror(errno);
-			cerr << utilname << ": could not execute " << LDCONFIG << ": " << msg << endl;
-			exit(EXIT_FAILURE);
-		} else {
-			if (waitpid(pid, 0, 0) == -1)
-				throw runtime_error_with_errno("waitpid() failed");
+void io_ring::statx(int dirfd, const char* name, int flags)
+{
+#ifdef HAVE_IO_URING
+	unsigned int slot;
+	struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(next_entry(slot));
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = reinterpret_cast<uintptr_t>(name);
+	sqe->len = STATX_TYPE;
+	sqe->off = reinterpret_cast<uintptr_t>(&statx_buffers[slot * sizeof(struct statx)]);
+	sqe->statx_flags = flags;
+#else
+	(void)dirfd;
+	(void)name;
+	(void)flags;
+#endif
+}
+
+void io_ring::unlinkat(int dirfd, const char* name, int flags)
+{
+#ifdef HAVE_IO_URING
+	unsigned int slot;
+	struct io_uring_sqe* sqe = static_cast<struct io_uring_sqe*>(next_entry(slot));
+	sqe->opcode = IORING_OP_UNLINKAT;
+	sqe->fd = dirfd;
+	sqe->addr = reinterpret_cast<uintptr_t>(name);
+	sqe->unlink_flags = flags;
+#else
+	(void)dirfd;
+	(void)name;
+	(void)flags;
+#endif
+}
+
+bool io_ring::submit()
+{
+#ifdef HAVE_IO_URING
+	while (!failed && (queued || inflight)) {
+		const long n = syscall(__NR_io_uring_enter, fd, queued, queued + inflight, IORING_ENTER_GETEVENTS, 0, 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			// Short of resources, let what is in flight finish first
+			if ((errno == EAGAIN || errno == EBUSY) && inflight) {
+				reap();
+				continue;
+			}
+			failed = true;
+			break;
 		}
+		queued -= n;
+		inflight += n;
+		reap();
 	}
+#endif
+	return !failed;
 }
 
-void pkgutil::pkg_footprint(string& filename) const
+void io_ring::reap()
 {
-	unsigned int i;
-	struct archive* archive;
-	struct archive_entry* entry;
+#ifdef HAVE_IO_URING
+	unsigned int head = *cq_head;
+	const unsigned int tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head) {
+		const struct io_uring_cqe* cqe = static_cast<struct io_uring_cqe*>(cqes) + (head & *cq_mask);
+		done[cqe->user_data] = cqe->res;
+		--inflight;
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+#endif
+}
 
-	map<string, mode_t> hardlink_target_modes;
+void io_ring::clear()
+{
+	done.clear();
+}
 
-	// We first do a run over the archive and remember the modes
-	// of regular files.
-	// In the second run, we print the footprint - using the stored
-	// modes for hardlinks.
-	//
-	// FIXME the code duplication here is butt ugly
-	archive = archive_read_new();
-	INIT_ARCHIVE(archive);
+vector<pkg_stats::phase_t> pkg_stats::phases;
+pthread_mutex_t pkg_stats::mutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned long long pkg_stats::counters[pkg_stats::COUNTERS];
+unsigned long long pkg_stats::start_wall;
+unsigned long long pkg_stats::start_cpu;
 
-	if (archive_read_open_filename(archive,
-	    const_cast<char*>(filename.c_str()),
-	    ARCHIVE_DEFAULT_BYTES_PER_BLOCK) != ARCHIVE_OK)
-                throw runtime_error_with_errno("could not open " + filename, archive_errno(archive));
+pkg_stats::phase::phase(const char* name)
+	: index(0), outermost(false), wall(0), cpu(0)
+{
+	pthread_mutex_lock(&mutex);
+	while (index < phases.size() && strcmp(phases[index].name, name))
+		++index;
+	if (index == phases.size()) {
+		phase_t p = { name, 0, 0, 0, 0 };
+		phases.push_back(p);
+	}
 
-	for (i = 0; archive_read_next_header(archive, &entry) ==
-	     ARCHIVE_OK; ++i) {
+	outermost = phases[index].active++ == 0;
+	if (outermost)
+		++phases[index].calls;
+	pthread_mutex_unlock(&mutex);
 
-		mode_t mode = archive_entry_mode(entry);
+	if (outermost) {
+		wall = wall_time();
+		cpu = cpu_time();
+	}
+}
 
-		if (!archive_entry_hardlink(entry)) {
-			const char *s = archive_entry_pathname(entry);
+pkg_stats::phase::~phase()
+{
+	unsigned long long wall_spent = 0;
+	unsigned long long cpu_spent = 0;
+	if (outermost) {
+		wall_spent = wall_time() - wall;
+		cpu_spent = cpu_time() - cpu;
+	}
 
-			hardlink_target_modes[s] = mode;
-		}
+	pthread_mutex_lock(&mutex);
+	--phases[index].active;
+	phases[index].wall += wall_spent;
+	phases[index].cpu += cpu_spent;
+	pthread_mutex_unlock(&mutex);
+}
 
-		if (S_ISREG(mode) && archive_read_data_skip(archive))
-			throw runtime_error_with_errno("could not read " + filename, archive_errno(archive));
+void pkg_stats::start()
+{
+	start_wall = wall_time();
+	start_cpu = cpu_time();
+}
+
+void pkg_stats::report(ostream& out, format_t format, const string& utility, int status)
+{
+	const unsigned long long wall = wall_time() - start_wall;
+	const unsigned long long cpu = cpu_time() - start_cpu;
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	static const char* counter_names[COUNTERS] = {
+		"bytes_inflated", "files_written", "files_unlinked", "lstat_calls", "fsync_calls"
+	};
+
+	pthread_mutex_lock(&mutex);
+	const vector<phase_t> phases = pkg_stats::phases;
+	pthread_mutex_unlock(&mutex);
+
+	if (format == JSON) {
+		out << "{\"utility\": \"" << utility << "\", "
+		    << "\"status\": " << status << ", "
+		    << "\"wall_us\": " << wall << ", "
+		    << "\"cpu_us\": " << cpu << ", "
+		    << "\"phases\": [";
+		for (vector<phase_t>::const_iterator i = phases.begin(); i != phases.end(); ++i)
+			out << (i == phases.begin() ? "" : ", ")
+			    << "{\"phase\": \"" << i->name << "\", "
+			    << "\"calls\": " << i->calls << ", "
+			    << "\"wall_us\": " << i->wall << ", "
+			    << "\"cpu_us\": " << i->cpu << "}";
+		out << "]";
+		for (int i = 0; i < COUNTERS; ++i)
+			out << ", \"" << counter_names[i] << "\": " << counters[i];
+		out << ", \"max_rss_kb\": " << usage.ru_maxrss << "}" << endl;
+		return;
 	}
 
-	archive_read_finish(archive);
+	char line[128];
+	snprintf(line, sizeof(line), "%-20s %8s %12s %12s", "phase", "calls", "wall ms", "cpu ms");
+	out << line << endl;
+	for (vector<phase_t>::const_iterator i = phases.begin(); i != phases.end(); ++i) {
+		snprintf(line, sizeof(line), "%-20s %8u %12.3f %12.3f", i->name, i->calls, i->wall / 1000.0, i->cpu / 1000.0);
+		out << line << endl;
+	}
+	snprintf(line, sizeof(line), "%-20s %8s %12.3f %12.3f", "total", "", wall / 1000.0, cpu / 1000.0);
+	out << line << endl;
+	for (int i = 0; i < COUNTERS; ++i) {
+		snprintf(line, sizeof(line), "%-20s %12llu", counter_names[i], counters[i]);
+		out << line << endl;
+	}
+	snprintf(line, sizeof(line), "%-20s %12ld", "max_rss_kb", usage.ru_maxrss);
+	out << line << endl;
+}
 
-	// Too bad, there doesn't seem to be a way to reuse our archive
-	// instance
-	archive = archive_read_new();
-	INIT_ARCHIVE(archive);
+unsigned long long pkg_stats::wall_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
 
-	if (archive_read_open_filename(archive,
-	    const_cast<char*>(filename.c_str()),
-	    ARCHIVE_DEFAULT_BYTES_PER_BLOCK) != ARCHIVE_OK)
-                throw runtime_error_with_errno("could not open " + filename, archive_errno(archive));
+unsigned long long pkg_stats::cpu_time()
+{
+	// All threads of the process, the workers included
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
 
-	for (i = 0; archive_read_next_header(archive, &entry) ==
-	     ARCHIVE_OK; ++i) {
-		mode_t mode = archive_entry_mode(entry);
+#define XXH_PRIME(high, low) ((uint64_t)(high) << 32 | (low))
 
-		// Access permissions
-		if (S_ISLNK(mode)) {
-			// Access permissions on symlinks differ among filesystems, e.g. XFS and ext2 have different.
-			// To avoid getting different footprints we always use "lrwxrwxrwx".
-			cout << "lrwxrwxrwx";
-		} else {
-			const char *h = archive_entry_hardlink(entry);
+static const uint64_t xxh_prime1 = XXH_PRIME(0x9E3779B1, 0x85EBCA87);
+static const uint64_t xxh_prime2 = XXH_PRIME(0xC2B2AE3D, 0x27D4EB4F);
+static const uint64_t xxh_prime3 = XXH_PRIME(0x165667B1, 0x9E3779F9);
+static const uint64_t xxh_prime4 = XXH_PRIME(0x85EBCA77, 0xC2B2AE63);
+static const uint64_t xxh_prime5 = XXH_PRIME(0x27D4EB2F, 0x165667C5);
 
-			if (h)
-				cout << mtos(hardlink_target_modes[h]);
-			else
-				cout << mtos(mode);
-		}
+static inline uint64_t xxh_rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
 
-		cout << '\t';
+static inline uint64_t xxh_read64(const unsigned char* p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+	       (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
 
-		// User
-		uid_t uid = archive_entry_uid(entry);
-		struct passwd* pw = getpwuid(uid);
-		if (pw)
-			cout << pw->pw_name;
-		else
-			cout << uid;
+static inline uint64_t xxh_read32(const unsigned char* p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24;
+}
 
-		cout << '/';
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+	return xxh_rotl(acc + input * xxh_prime2, 31) * xxh_prime1;
+}
 
-		// Group
-		gid_t gid = archive_entry_gid(entry);
-		struct group* gr = getgrgid(gid);
-		if (gr)
-			cout << gr->gr_name;
-		else
-			cout << gid;
-
-		// Filename
-		cout << '\t' << archive_entry_pathname(entry);
-
-		// Special cases
-		if (S_ISLNK(mode)) {
-			// Symlink
-			cout << " -> " << archive_entry_symlink(entry);
-		} else if (S_ISCHR(mode) ||
-		           S_ISBLK(mode)) {
-			// Device
-			cout << " (" << archive_entry_rdevmajor(entry)
-			     << ", " << archive_entry_rdevminor(entry)
-			     << ")";
-		} else if (S_ISREG(mode) &&
-		           archive_entry_size(entry) == 0) {
-			// Empty regular file
-			cout << " (EMPTY)";
-		}
-
-		cout << '\n';
-		
-		if (S_ISREG(mode) && archive_read_data_skip(archive))
-			throw runtime_error_with_errno("could not read " + filename, archive_errno(archive));
+static inline uint64_t xxh_merge(uint64_t hash, uint64_t acc)
+{
+	return (hash ^ xxh_round(0, acc)) * xxh_prime1 + xxh_prime4;
+}
+
+xxh64::xxh64(uint64_t seed)
+	: seed(seed), total(0), buffered(0)
+{
+	acc[0] = seed + xxh_prime1 + xxh_prime2;
+	acc[1] = seed + xxh_prime2;
+	acc[2] = seed;
+	acc[3] = seed - xxh_prime1;
+}
+
+void xxh64::update(const void* data, size_t length)
+{
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	const unsigned char* end = p + length;
+	total += length;
+
+	if (buffered + length < sizeof(buffer)) {
+		memcpy(buffer + buffered, p, length);
+		buffered += length;
+		return;
 	}
-   
-	if (i == 0) {
-		if (archive_errno(archive) == 0)
-			throw runtime_error("empty package");
-		else
-			throw runtime_error("could not read " + filename);
+
+	if (buffered) {
+		size_t fill = sizeof(buffer) - buffered;
+		memcpy(buffer + buffered, p, fill);
+		for (int i = 0; i < 4; ++i)
+			acc[i] = xxh_round(acc[i], xxh_read64(buffer + i * 8));
+		p += fill;
+		buffered = 0;
+	}
+
+	for (; end - p >= 32; p += 32) {
+		acc[0] = xxh_round(acc[0], xxh_read64(p));
+		acc[1] = xxh_round(acc[1], xxh_read64(p + 8));
+		acc[2] = xxh_round(acc[2], xxh_read64(p + 16));
+		acc[3] = xxh_round(acc[3], xxh_read64(p + 24));
 	}
 
-	archive_read_finish(archive);
+	memcpy(buffer, p, end - p);
+	buffered = end - p;
 }
 
-void pkgutil::print_version() const
+uint64_t xxh64::digest() const
 {
-	cout << utilname << " (pkgutils) " << VERSION << endl;
+	uint64_t hash;
+
+	if (total >= 32) {
+		hash = xxh_rotl(acc[0], 1) + xxh_rotl(acc[1], 7) + xxh_rotl(acc[2], 12) + xxh_rotl(acc[3], 18);
+		for (int i = 0; i < 4; ++i)
+			hash = xxh_merge(hash, acc[i]);
+	} else {
+		hash = seed + xxh_prime5;
+	}
+	hash += total;
+
+	const unsigned char* p = buffer;
+	const unsigned char* end = buffer + buffered;
+	for (; end - p >= 8; p += 8)
+		hash = xxh_rotl(hash ^ xxh_round(0, xxh_read64(p)), 27) * xxh_prime1 + xxh_prime4;
+	if (end - p >= 4) {
+		hash = xxh_rotl(hash ^ xxh_read32(p) * xxh_prime1, 23) * xxh_prime2 + xxh_prime3;
+		p += 4;
+	}
+	for (; p < end; ++p)
+		hash = xxh_rotl(hash ^ *p * xxh_prime5, 11) * xxh_prime1;
+
+	hash ^= hash >> 33;
+	hash *= xxh_prime2;
+	hash ^= hash >> 29;
+	hash *= xxh_prime3;
+	hash ^= hash >> 32;
+	return hash;
 }
 
-db_lock::db_lock(const string& root, bool exclusive)
+db_lock::db_lock(const string& root, bool exclusive, unsigned int timeout)
 	: dir(0)
 {
 	const string dirname = trim_filename(root + string("/") + PKG_DIR);
@@ -624,11 +3975,25 @@ db_lock::db_lock(const string& root, bool exclusive)
 	if (!(dir = opendir(dirname.c_str())))
 		throw runtime_error_with_errno("could not read directory " + dirname);
 
-	if (flock(dirfd(dir), (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) == -1) {
-		if (errno == EWOULDBLOCK)
+	// Wait up to timeout seconds for the holder to finish, polling at
+	// growing intervals rather than blocking so the wait is bounded
+	struct timeval now;
+	gettimeofday(&now, 0);
+	const long long deadline = (now.tv_sec + (long long)timeout) * 1000000 + now.tv_usec;
+	for (useconds_t interval = LOCK_POLL_MIN; flock(dirfd(dir), (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) == -1;
+	     interval = min(interval * 2, (useconds_t)LOCK_POLL_MAX)) {
+		if (errno != EWOULDBLOCK) {
+			int e = errno;
+			closedir(dir);
+			throw runtime_error_with_errno("could not lock directory " + dirname, e);
+		}
+		gettimeofday(&now, 0);
+		const long long left = deadline - (now.tv_sec * 1000000LL + now.tv_usec);
+		if (left <= 0) {
+			closedir(dir);
 			throw runtime_error("package database is currently locked by another process");
-		else
-			throw runtime_error_with_errno("could not lock directory " + dirname);
+		}
+		usleep(min((long long)interval, left));
 	}
 }
 
@@ -716,49 +4081,86 @@ string trim_filename(const string& filename)
 bool file_exists(const string& filename)
 {
 	struct stat buf;
-	return !lstat(filename.c_str(), &buf);
+	return !lstat_counted(filename.c_str(), &buf);
 }
 
 bool file_empty(const string& filename)
 {
 	struct stat buf;
 
-	if (lstat(filename.c_str(), &buf) == -1)
+	if (lstat_counted(filename.c_str(), &buf) == -1)
 		return false;
 	
 	return (S_ISREG(buf.st_mode) && buf.st_size == 0);
 }
 
+//
+// Compares two open files of the given size, mapped into memory when
+// possible and read in large blocks otherwise.
+//
+static bool contents_equal(int fd1, int fd2, off_t size)
+{
+	if (size == 0)
+		return true;
+
+	void* map1 = mmap(0, size, PROT_READ, MAP_PRIVATE, fd1, 0);
+	void* map2 = map1 == MAP_FAILED ? MAP_FAILED : mmap(0, size, PROT_READ, MAP_PRIVATE, fd2, 0);
+	if (map2 != MAP_FAILED) {
+		madvise(map1, size, MADV_SEQUENTIAL);
+		madvise(map2, size, MADV_SEQUENTIAL);
+		bool equal = !memcmp(map1, map2, size);
+		munmap(map1, size);
+		munmap(map2, size);
+		return equal;
+	}
+	if (map1 != MAP_FAILED)
+		munmap(map1, size);
+
+	const size_t block = 256 * 1024;
+	vector<char> buffer1(block);
+	vector<char> buffer2(block);
+	for (off_t offset = 0; offset < size;) {
+		size_t length = size - offset < (off_t)block ? size - offset : block;
+		if (pread(fd1, &buffer1[0], length, offset) != (ssize_t)length ||
+		    pread(fd2, &buffer2[0], length, offset) != (ssize_t)length ||
+		    memcmp(&buffer1[0], &buffer2[0], length))
+			return false;
+		offset += length;
+	}
+
+	return true;
+}
+
 bool file_equal(const string& file1, const string& file2)
 {
 	struct stat buf1, buf2;
 
-	if (lstat(file1.c_str(), &buf1) == -1)
+	if (lstat_counted(file1.c_str(), &buf1) == -1)
 		return false;
 
-	if (lstat(file2.c_str(), &buf2) == -1)
+	if (lstat_counted(file2.c_str(), &buf2) == -1)
 		return false;
 
 	// Regular files
 	if (S_ISREG(buf1.st_mode) && S_ISREG(buf2.st_mode)) {
-		ifstream f1(file1.c_str());
-		ifstream f2(file2.c_str());
-	
-		if (!f1 || !f2)
+		if (buf1.st_size != buf2.st_size)
 			return false;
+		if (buf1.st_dev == buf2.st_dev && buf1.st_ino == buf2.st_ino)
+			return true;
 
-		while (!f1.eof()) {
-			char buffer1[4096];
-			char buffer2[4096];
-			f1.read(buffer1, 4096);
-			f2.read(buffer2, 4096);
-			if (f1.gcount() != f2.gcount() ||
-			    memcmp(buffer1, buffer2, f1.gcount()) ||
-			    f1.eof() != f2.eof())
-				return false;
+		int fd1 = open(file1.c_str(), O_RDONLY);
+		if (fd1 == -1)
+			return false;
+		int fd2 = open(file2.c_str(), O_RDONLY);
+		if (fd2 == -1) {
+			close(fd1);
+			return false;
 		}
 
-		return true;
+		bool equal = contents_equal(fd1, fd2, buf1.st_size);
+		close(fd1);
+		close(fd2);
+		return equal;
 	}
 	// Symlinks
 	else if (S_ISLNK(buf1.st_mode) && S_ISLNK(buf2.st_mode)) {
@@ -793,10 +4195,10 @@ bool permissions_equal(const string& file1, const string& file2)
 	struct stat buf1;
 	struct stat buf2;
 
-	if (lstat(file1.c_str(), &buf1) == -1)
+	if (lstat_counted(file1.c_str(), &buf1) == -1)
 		return false;
 
-	if (lstat(file2.c_str(), &buf2) == -1)
+	if (lstat_counted(file2.c_str(), &buf2) == -1)
 		return false;
 	
 	return(buf1.st_mode == buf2.st_mode) &&
@@ -804,6 +4206,41 @@ bool permissions_equal(const string& file1, const string& file2)
 		(buf1.st_gid == buf2.st_gid);
 }
 
+bool file_hash(int fd, uint64_t& hash)
+{
+	xxh64 state;
+	vector<char> buffer(256 * 1024);
+	ssize_t length;
+
+	while ((length = read(fd, &buffer[0], buffer.size())) > 0)
+		state.update(&buffer[0], length);
+	if (length == -1)
+		return false;
+
+	hash = state.digest();
+	return true;
+}
+
+bool pkg_is_delta(const string& filename)
+{
+	const string extension = PKG_DELTA_EXT;
+	return filename.size() > extension.size() &&
+	       !filename.compare(filename.size() - extension.size(), extension.size(), extension);
+}
+
+string pkg_full_package(const string& filename)
+{
+	if (!pkg_is_delta(filename))
+		return "";
+
+	const string stem(filename, 0, filename.size() - strlen(PKG_DELTA_EXT));
+	for (size_t n = 0; n < sizeof(pkg_extensions) / sizeof(pkg_extensions[0]); ++n)
+		if (file_exists(stem + pkg_extensions[n]))
+			return stem + pkg_extensions[n];
+
+	return "";
+}
+
 void file_remove(const string& basedir, const string& filename)
 {
 	if (filename != basedir && !remove(filename.c_str())) {
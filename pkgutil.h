@@ -24,34 +24,262 @@
 #define PKGUTIL_H
 
 #include <string>
+#include <vector>
+#include <deque>
 #include <set>
 #include <map>
+#include <iterator>
 #include <iostream>
 #include <stdexcept>
 #include <cerrno>
 #include <cstring>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #define PKG_EXT         ".pkg.tar.gz"
+#define PKG_EXT_XZ      ".pkg.tar.xz"
+#define PKG_EXT_ZST     ".pkg.tar.zst"
+#define PKG_DELTA_EXT   ".delta.tar.gz"
+#define PKG_MANIFEST_EXT ".manifest"
 #define PKG_DIR         "var/lib/pkg"
 #define PKG_DB          "var/lib/pkg/db"
+#define PKG_DB_BIN      "var/lib/pkg/db.bin"
+#define PKG_DB_JOURNAL  "var/lib/pkg/db.journal"
 #define PKG_REJECTED    "var/lib/pkg/rejected"
+#define PKG_LDCONFIG    "var/lib/pkg/ldconfig"
+#define PKG_SUMS        "var/lib/pkg/sums"
+#define PKG_DAEMON_SOCKET "var/lib/pkg/pkgutild.socket"
+#define DAEMON_TIMEOUT  10
 #define VERSION_DELIM   '#'
 #define LDCONFIG        "/sbin/ldconfig"
 #define LDCONFIG_CONF   "/etc/ld.so.conf"
+#define XZ_DECOMPRESS   "xz -dc"
+#define ZSTD_DECOMPRESS "zstd -dcq"
+#define ZSTD_PATCH      "zstd"
+#define MAX_JOBS        16
+#define IO_RING_ENTRIES 64
+#define IO_RING_MIN_BATCH 8
+#define LOCK_POLL_MIN   10000
+#define LOCK_POLL_MAX   250000
+#define PATH_BLOCK_SIZE 65536
 
 using namespace std;
 
+class pkg_stage;
+
+//
+// Binary image of the package database. The image is generated from the
+// text database whenever the database is compacted and is only used while
+// the text database is the one it was generated from or one written by a
+// transaction in the journal since (inode, size and mtime), so hand-edited
+// or foreign databases are always read from the text file.
+//
+// Layout: header, package table (sorted by name), file table (one sorted
+// run of string offsets per package), path index (every distinct path in
+// sorted order with the packages owning it), owner table and a string
+// table holding names, versions and every distinct path exactly once.
+//
+class db_image {
+public:
+	struct header_t {
+		char magic[8];
+		uint32_t byte_order;
+		uint32_t npackages;
+		uint32_t packages;
+		uint32_t nfiles;
+		uint32_t files;
+		uint32_t npaths;
+		uint32_t paths;
+		uint32_t nowners;
+		uint32_t owners;
+		uint32_t strings;
+		uint32_t strings_size;
+		uint32_t generation;
+		uint64_t db_ino;
+		uint64_t db_size;
+		int64_t db_mtime;
+		int64_t db_mtime_nsec;
+	};
+
+	struct package_t {
+		uint32_t name;
+		uint32_t version;
+		uint32_t files;
+		uint32_t nfiles;
+	};
+
+	struct path_t {
+		uint32_t path;
+		uint32_t owners;
+		uint32_t nowners;
+	};
+
+	// Package to lay out in an image, with its files in sorted order
+	struct record_t {
+		const char* name;
+		const char* version;
+		vector<const char*> files;
+	};
+
+	static void build(const vector<record_t>& records, uint32_t generation,
+	                  const struct stat* db_stat, string& image);
+
+	db_image() : data(0), size(0) {}
+	~db_image() { unmap(); }
+	bool map(const string& filename);
+	void load(string& image);
+	void unmap();
+	bool loaded() const { return data != 0; }
+	bool matches(const struct stat& db_stat) const;
+	uint32_t generation() const { return header()->generation; }
+	uint32_t pkg_count() const { return header()->npackages; }
+	const package_t& pkg(uint32_t index) const;
+	const package_t* pkg_find(const string& name) const;
+	const uint32_t* pkg_files(const package_t& pkg) const;
+	uint32_t path_count() const { return header()->npaths; }
+	const path_t& path(uint32_t index) const;
+	uint32_t path_lower_bound(const char* path) const;
+	const path_t* path_find(const string& path) const;
+	const uint32_t* path_owners(const path_t& path) const;
+	const char* str(uint32_t offset) const;
+
+private:
+	db_image(const db_image&);
+	db_image& operator=(const db_image&);
+	const header_t* header() const { return reinterpret_cast<const header_t*>(data); }
+	bool check() const;
+
+	char* data;
+	size_t size;
+	string buffer;
+};
+
+//
+// Paths of installed files, each distinct path stored once for all
+// packages. Paths are copied into blocks that are never moved or freed,
+// so they can be referred to by pointer as well as by id, and are found
+// again through an open addressing hash table. Paths are only interned
+// by the main thread.
+//
+class path_pool {
+public:
+	typedef uint32_t id_t;
+
+	path_pool() : used(PATH_BLOCK_SIZE) {}
+	~path_pool();
+	id_t intern(const char* path, size_t length);
+	const char* str(id_t id) const { return paths[id]; }
+	size_t size() const { return paths.size(); }
+
+private:
+	path_pool(const path_pool&);
+	path_pool& operator=(const path_pool&);
+	void rehash(size_t count);
+
+	// Id + 1, 0 for empty buckets, next to the hash of the path
+	struct bucket_t {
+		uint32_t hash;
+		id_t id;
+	};
+
+	vector<const char*> paths;
+	vector<bucket_t> buckets;
+	vector<char*> blocks;
+	size_t used;
+};
+
+//
+// Files of a package, as a vector of interned path ids sorted by path.
+// Offers the part of the set<string> interface pkgutils uses, iterators
+// point to the paths in the pool shared by all packages.
+//
+class file_list {
+public:
+	typedef vector<path_pool::id_t>::const_iterator id_iterator;
+
+	class const_iterator {
+	public:
+		typedef bidirectional_iterator_tag iterator_category;
+		typedef const char* value_type;
+		typedef ptrdiff_t difference_type;
+		typedef const char* const* pointer;
+		typedef const char* reference;
+
+		const_iterator() {}
+		explicit const_iterator(id_iterator i) : i(i) {}
+		const char* operator*() const { return pool.str(*i); }
+		const_iterator& operator++() { ++i; return *this; }
+		const_iterator operator++(int) { return const_iterator(i++); }
+		const_iterator& operator--() { --i; return *this; }
+		const_iterator operator--(int) { return const_iterator(i--); }
+		bool operator==(const const_iterator& other) const { return i == other.i; }
+		bool operator!=(const const_iterator& other) const { return i != other.i; }
+		id_iterator id() const { return i; }
+	private:
+		id_iterator i;
+	};
+
+	const_iterator begin() const { return const_iterator(ids.begin()); }
+	const_iterator end() const { return const_iterator(ids.end()); }
+	size_t size() const { return ids.size(); }
+	bool empty() const { return ids.empty(); }
+	void clear() { ids.clear(); }
+	void swap(file_list& other) { ids.swap(other.ids); }
+	const_iterator lower_bound(const char* path) const;
+	const_iterator find(const char* path) const;
+	const_iterator find(const string& path) const { return find(path.c_str()); }
+	void insert(const char* path);
+	void insert(const string& path) { insert(path.c_str()); }
+	void erase(const string& path);
+
+	// Adds a path without keeping the list sorted, for paths that come
+	// in no particular order, sort() has to be called once they are in
+	void append(const char* path) { ids.push_back(pool.intern(path, strlen(path))); }
+	void sort();
+
+	static path_pool pool;
+
+private:
+	vector<path_pool::id_t> ids;
+};
+
 class pkgutil {
 public:
 	struct pkginfo_t {
 		string version;
-		set<string> files;
+		file_list files;
 	};
 
 	typedef map<string, pkginfo_t> packages_t;
 
+	// Installed regular file as written by pkgadd
+	struct file_sum_t {
+		uint64_t hash;
+		off_t size;
+		time_t mtime;
+	};
+
+	typedef map<string, file_sum_t> file_sums_t;
+
+	// Member of a package archive, as listed in its manifest
+	struct entry_t {
+		string path;
+		mode_t mode;
+		uid_t uid;
+		gid_t gid;
+		off_t size;
+		time_t mtime;
+		unsigned int rdevmajor;
+		unsigned int rdevminor;
+		string symlink;
+		string hardlink;
+	};
+
+	typedef vector<entry_t> manifest_t;
+
 	explicit pkgutil(const string& name);
 	virtual ~pkgutil() {}
 	virtual void run(int argc, char** argv) = 0;
@@ -61,28 +289,274 @@ public:
 protected:
 	// Database
 	void db_open(const string& path);
+	void db_close();
 	void db_commit();
+	void db_load_files(const string& name);
 	void db_add_pkg(const string& name, const pkginfo_t& info);
 	bool db_find_pkg(const string& name);
 	void db_rm_pkg(const string& name);
+	void db_rm_pkgs(const set<string>& names);
 	void db_rm_pkg(const string& name, const set<string>& keep_list);
 	void db_rm_files(set<string> files, const set<string>& keep_list);
+	void db_find_owners(const string& file, set<string>& owners);
+	void db_find_owners(const string& pattern, vector<pair<string, string> >& result);
 	set<string> db_find_conflicts(const string& name, const pkginfo_t& info);
+	void probe_files(const file_list& files, set<string>& found) const;
+	void remove_files(const set<string>& files, bool keep_non_empty) const;
+	bool db_read_sums(const string& name, const string& version, file_sums_t& sums) const;
+	void db_write_sums(const string& name, const string& version, const file_sums_t& sums) const;
+	void db_rm_sums(const string& name) const;
+	void db_verify(const set<string>& names, bool quick, map<pair<string, string>, string>& problems, set<string>& unrecorded);
 
 	// Tar.gz
 	pair<string, pkginfo_t> pkg_open(const string& filename) const;
-	void pkg_install(const string& filename, const set<string>& keep_list, const set<string>& non_install_files) const;
+	pair<string, pkginfo_t> pkg_open(const string& filename, string& stage) const;
+	void pkg_install(const string& filename, const set<string>& keep_list, const set<string>& non_install_files,
+	                 const file_sums_t& installed_sums, file_sums_t& sums) const;
 	void pkg_footprint(string& filename) const;
+	void pkg_manifest(const string& filename) const;
+	void pkg_delta(const string& base, const string& filename) const;
+	pair<string, pkginfo_t> pkg_open_delta(const string& filename, pkg_stage& stage, const string& staged);
+	void pkg_rebuild_delta(const string& filename, pkg_stage& stage, const string& staged);
+	void pkg_scan(const string& filename, manifest_t& manifest) const;
+	bool pkg_read_manifest(const string& filename, manifest_t& manifest) const;
+	void print_footprint_entry(const entry_t& entry, const map<string, mode_t>& hardlink_target_modes) const;
+	void ldconfig_trigger(const set<string>& files);
+	void ldconfig_trigger(const file_list& files);
 	void ldconfig() const;
 
 	string utilname;
 	packages_t packages;
 	string root;
+	unsigned int jobs;
+	bool defer_ldconfig;
+
+private:
+	void db_build_image(string& image, const struct stat* db_stat) const;
+	void db_commit_image(const struct stat& db_stat) const;
+	void db_index();
+	void db_list_files(const string& name, const pkginfo_t& info, vector<const char*>& files) const;
+	void db_read(const string& filename, struct stat& db_stat);
+	bool db_replay_journal(const struct stat& db_stat);
+	void db_append_journal(const struct stat& db_stat);
+	void db_compact();
+	void db_write(const string& filename, bool sync, struct stat& db_stat) const;
+	void db_replace(const string& filename) const;
+	void read_library_dirs(const string& filename, int depth);
+	void ldconfig_check(const string& file);
+	pair<string, pkginfo_t> pkg_read_delta(const string& filename, pkg_stage& stage, const string& staged, bool check_version);
+
+	db_image image;
+	set<string> unloaded;
+	set<string> dirty;
+
+	// Set when installed or removed files need ldconfig to be run,
+	// against the library directories of the root
+	bool ldconfig_triggered;
+	set<string> library_dirs;
+	bool library_dirs_read;
+
+	// User and group names, looked up once per id
+	mutable map<uid_t, string> user_names;
+	mutable map<gid_t, string> group_names;
+
+	// Journal of transactions committed since the database was last
+	// compacted, appended to as long as the image it applies to is used
+	set<string> pending;
+	bool journaled;
+	off_t journal_size;
+	struct stat db_file_stat;
+	uint32_t generation;
+};
+
+//
+// Temporary files in a directory, such as the uncompressed copies of
+// packages kept under the package directory between pkg_open and
+// pkg_install. Files that are still around when the stage goes out of
+// scope are removed.
+//
+class pkg_stage {
+public:
+	pkg_stage(const string& dir, const string& prefix);
+	~pkg_stage();
+	string create();
+	void remove(const string& filename);
+private:
+	pkg_stage(const pkg_stage&);
+	pkg_stage& operator=(const pkg_stage&);
+
+	string dir;
+	string prefix;
+	vector<string> files;
+};
+
+//
+// Fixed set of worker threads running jobs from a bounded queue. Jobs
+// are deleted once they have run. A pool without threads runs every job
+// in the calling thread, as worker 0. Worker threads are numbered from 1,
+// so callers can keep per-worker state in a vector of size() entries.
+//
+class thread_pool {
+public:
+	class job {
+	public:
+		virtual ~job() {}
+		virtual void run(unsigned int worker) = 0;
+	};
+
+	explicit thread_pool(unsigned int threads, unsigned int max_queued = 64);
+	~thread_pool();
+	void add(job* j);
+	void wait();
+	unsigned int size() const { return threads.size() + 1; }
+private:
+	thread_pool(const thread_pool&);
+	thread_pool& operator=(const thread_pool&);
+
+	static void* worker(void* arg);
+	static void run_job(job* j, unsigned int worker);
+
+	vector<pthread_t> threads;
+	deque<job*> queue;
+	unsigned int max_queued;
+	unsigned int busy;
+	unsigned int started;
+	bool stopping;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t space_cond;
+	pthread_cond_t idle_cond;
+};
+
+//
+// Submission and completion rings of io_uring(7), to hand the kernel the
+// lookups or removals of a whole directory at once instead of making one
+// system call for each. Results are kept in the order the operations
+// were queued in, 0 or -errno. A ring that could not be set up, because
+// the kernel is too old or io_uring is disabled, is not available() and
+// callers make the calls themselves, as they must when submit() fails.
+//
+class io_ring {
+public:
+	explicit io_ring(unsigned int entries = IO_RING_ENTRIES);
+	~io_ring();
+	bool available() const { return fd != -1 && !failed; }
+	void statx(int dirfd, const char* name, int flags);
+	void unlinkat(int dirfd, const char* name, int flags);
+	bool submit();
+	void clear();
+	const vector<int>& results() const { return done; }
+private:
+	io_ring(const io_ring&);
+	io_ring& operator=(const io_ring&);
+
+	void* next_entry(unsigned int& slot);
+	void reap();
+
+	int fd;
+	bool failed;
+	unsigned int entries;
+	unsigned int queued;
+	unsigned int inflight;
+	vector<int> done;
+	vector<char> statx_buffers;
+	void* sq_map;
+	size_t sq_map_size;
+	void* cq_map;
+	size_t cq_map_size;
+	void* sqes;
+	size_t sqes_size;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	void* cqes;
+};
+
+//
+// Wall and CPU time spent in each phase of a run and counts of the work
+// done, reported with --stats. Phases entered again while they are
+// active, from inside themselves or from another thread, count only
+// once. Phases and counters may be used from any thread.
+//
+class pkg_stats {
+public:
+	enum format_t {
+		NONE,
+		TEXT,
+		JSON
+	};
+
+	enum counter_t {
+		BYTES_INFLATED,
+		FILES_WRITTEN,
+		FILES_UNLINKED,
+		LSTAT_CALLS,
+		FSYNC_CALLS,
+		COUNTERS
+	};
+
+	class phase {
+	public:
+		explicit phase(const char* name);
+		~phase();
+	private:
+		phase(const phase&);
+		phase& operator=(const phase&);
+
+		size_t index;
+		bool outermost;
+		unsigned long long wall;
+		unsigned long long cpu;
+	};
+
+	static void start();
+	static void add(counter_t counter, unsigned long long n = 1)
+	{
+		__atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+	}
+	static void report(ostream& out, format_t format, const string& utility, int status);
+
+private:
+	struct phase_t {
+		const char* name;
+		unsigned int calls;
+		unsigned int active;
+		unsigned long long wall;
+		unsigned long long cpu;
+	};
+
+	static unsigned long long wall_time();
+	static unsigned long long cpu_time();
+
+	static vector<phase_t> phases;
+	static pthread_mutex_t mutex;
+	static unsigned long long counters[COUNTERS];
+	static unsigned long long start_wall;
+	static unsigned long long start_cpu;
+};
+
+//
+// XXH64 hash, fed incrementally.
+//
+class xxh64 {
+public:
+	explicit xxh64(uint64_t seed = 0);
+	void update(const void* data, size_t length);
+	uint64_t digest() const;
+private:
+	uint64_t seed;
+	uint64_t acc[4];
+	uint64_t total;
+	unsigned char buffer[32];
+	size_t buffered;
 };
 
 class db_lock {
 public:
-	db_lock(const string& root, bool exclusive);
+	db_lock(const string& root, bool exclusive, unsigned int timeout = 0);
 	~db_lock();
 private:
 	DIR* dir;
@@ -105,6 +579,9 @@ bool file_exists(const string& filename);
 bool file_empty(const string& filename);
 bool file_equal(const string& file1, const string& file2);
 bool permissions_equal(const string& file1, const string& file2);
+bool file_hash(int fd, uint64_t& hash);
+bool pkg_is_delta(const string& filename);
+string pkg_full_package(const string& filename);
 void file_remove(const string& basedir, const string& filename);
 
 #endif /* PKGUTIL_H */
@@ -0,0 +1,340 @@
+//
+//  pkgutils
+// 
+//  Copyright (c) 2000-2005 Per Liden
+//  Copyright (c) 2006-2007 by CRUX team (http://crux.nu)
+// 
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+//
+
+#include "pkgutild.h"
+#include <sstream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <sys/un.h>
+#include <time.h>
+
+volatile sig_atomic_t pkgutild::terminated = 0;
+
+static long long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void pkgutild::run(int argc, char** argv)
+{
+	//
+	// Check command line options
+	//
+	string o_root;
+
+	for (int i = 1; i < argc; ++i) {
+		string option(argv[i]);
+		if (option == "-r" || option == "--root") {
+			assert_argument(argv, argc, i);
+			o_root = argv[i + 1];
+			i++;
+		} else {
+			throw runtime_error("invalid option " + option);
+		}
+	}
+
+	db_root = o_root;
+	const string socket_name = trim_filename(o_root + "/") + PKG_DAEMON_SOCKET;
+	struct sockaddr_un address;
+	if (socket_name.length() >= sizeof(address.sun_path))
+		throw runtime_error("socket path " + socket_name + " too long");
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_name.c_str());
+
+	//
+	// Read the database before taking over the socket
+	//
+	memset(&db_read_stat, 0, sizeof(db_read_stat));
+	memset(&journal_read_stat, 0, sizeof(journal_read_stat));
+	db_changed(db_read_stat, journal_read_stat);
+	db_open(o_root);
+	loaded = true;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		throw runtime_error_with_errno("could not create socket");
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	// A socket left behind by a daemon that did not exit cleanly is
+	// replaced, one that is still answered is not
+	if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+		close(fd);
+		throw runtime_error("already running on " + socket_name);
+	}
+	unlink(socket_name.c_str());
+
+	if (bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+		int e = errno;
+		close(fd);
+		throw runtime_error_with_errno("could not bind " + socket_name, e);
+	}
+
+	if (chmod(socket_name.c_str(), 0666) == -1 || listen(fd, SOMAXCONN) == -1) {
+		int e = errno;
+		close(fd);
+		unlink(socket_name.c_str());
+		throw runtime_error_with_errno("could not listen on " + socket_name, e);
+	}
+
+	//
+	// Answer queries until told to terminate, the signals are only
+	// delivered while waiting for clients
+	//
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = terminate;
+	sigaction(SIGHUP, &sa, 0);
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+
+	sigset_t blocked, waiting;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGHUP);
+	sigaddset(&blocked, SIGINT);
+	sigaddset(&blocked, SIGTERM);
+	sigprocmask(SIG_BLOCK, &blocked, &waiting);
+
+	vector<client_t> clients;
+	while (!terminated) {
+		vector<struct pollfd> pfds(clients.size() + 1);
+		pfds[0].fd = fd;
+		pfds[0].events = POLLIN;
+
+		long long now = now_ms();
+		long long wait = -1;
+		for (vector<client_t>::size_type i = 0; i < clients.size(); ++i) {
+			pfds[i + 1].fd = clients[i].fd;
+			pfds[i + 1].events = clients[i].answered ? POLLOUT : POLLIN;
+			if (wait == -1 || clients[i].deadline - now < wait)
+				wait = max(0LL, clients[i].deadline - now);
+		}
+
+		struct timespec timeout = { wait / 1000, (wait % 1000) * 1000000 };
+		if (ppoll(&pfds[0], pfds.size(), wait == -1 ? 0 : &timeout, &waiting) == -1)
+			continue;
+
+		// Clients are dropped once they are done, fail or run out of
+		// time. Whatever they sent in time is still read, in case
+		// answering others kept them waiting, and a client reading
+		// its answer has time again after each part it takes
+		now = now_ms();
+		for (vector<client_t>::size_type i = clients.size(); i-- > 0;) {
+			client_t& client = clients[i];
+			bool keep = true;
+			if (pfds[i + 1].revents)
+				keep = client.answered ? transmit(client, now) : receive(client, now);
+			if (!keep || (now >= client.deadline && !reading(client, now))) {
+				close(client.fd);
+				clients.erase(clients.begin() + i);
+			}
+		}
+
+		if (!(pfds[0].revents & POLLIN))
+			continue;
+
+		int client = accept(fd, 0, 0);
+		if (client == -1)
+			continue;
+		fcntl(client, F_SETFD, FD_CLOEXEC);
+		fcntl(client, F_SETFL, O_NONBLOCK);
+
+		// The client waiting longest makes room for a new one
+		if (clients.size() == DAEMON_CLIENTS_MAX) {
+			close(clients.front().fd);
+			clients.erase(clients.begin());
+		}
+
+		client_t connection;
+		connection.fd = client;
+		connection.sent = 0;
+		connection.queued = 0;
+		connection.answered = false;
+		connection.deadline = now + DAEMON_CLIENT_TIMEOUT;
+		clients.push_back(connection);
+	}
+
+	for (vector<client_t>::const_iterator i = clients.begin(); i != clients.end(); ++i)
+		close(i->fd);
+	close(fd);
+	unlink(socket_name.c_str());
+}
+
+void pkgutild::terminate(int)
+{
+	terminated = 1;
+}
+
+bool pkgutild::db_changed(struct stat& db_stat, struct stat& journal_stat) const
+{
+	const string path = trim_filename(db_root + "/");
+
+	memset(&db_stat, 0, sizeof(db_stat));
+	memset(&journal_stat, 0, sizeof(journal_stat));
+	stat((path + PKG_DB).c_str(), &db_stat);
+	stat((path + PKG_DB_JOURNAL).c_str(), &journal_stat);
+
+	return db_stat.st_ino != db_read_stat.st_ino ||
+	       db_stat.st_size != db_read_stat.st_size ||
+	       db_stat.st_mtime != db_read_stat.st_mtime ||
+	       journal_stat.st_ino != journal_read_stat.st_ino ||
+	       journal_stat.st_size != journal_read_stat.st_size ||
+	       journal_stat.st_mtime != journal_read_stat.st_mtime;
+}
+
+bool pkgutild::db_reload()
+{
+	struct stat db_stat;
+	struct stat journal_stat;
+	if (!db_changed(db_stat, journal_stat))
+		return true;
+
+	// The files are looked at before they are read, so a change made
+	// while reading them is picked up by the next query. Once the old
+	// database has been dropped, queries are left to the clients until
+	// it can be read again
+	try {
+		db_close();
+		loaded = false;
+		db_open(db_root);
+		loaded = true;
+		db_read_stat = db_stat;
+		journal_read_stat = journal_stat;
+	} catch (runtime_error& e) {
+		cerr << utilname << ": " << e.what() << endl;
+	}
+
+	return loaded;
+}
+
+bool pkgutild::receive(client_t& client, long long now)
+{
+	// The request is a command and its argument, each terminated by a
+	// null character, and ends when the client shuts down its side
+	char buf[4096];
+	ssize_t length;
+	while ((length = read(client.fd, buf, sizeof(buf))) > 0) {
+		client.request.append(buf, length);
+		if (client.request.size() > DAEMON_REQUEST_MAX)
+			return false;
+	}
+
+	if (length == -1)
+		return errno == EAGAIN || errno == EINTR;
+
+	const string& request = client.request;
+	string::size_type end = request.find('\0');
+	if (end == string::npos || request.find('\0', end + 1) != request.size() - 1)
+		return false;
+
+	if (!db_reload())
+		return false;
+
+	try {
+		answer(request.substr(0, end), request.substr(end + 1, request.size() - end - 2), client.response);
+	} catch (runtime_error& e) {
+		client.response = string("error\n") + e.what();
+	}
+
+	client.answered = true;
+	return transmit(client, now);
+}
+
+bool pkgutild::transmit(client_t& client, long long now)
+{
+	// The answer is sent in parts, so the socket shows how much of it
+	// the client has read. The client gets as long again to read each
+	// part
+	while (client.sent < client.response.size()) {
+		ssize_t n = send(client.fd, client.response.data() + client.sent,
+		                 min(client.response.size() - client.sent, (string::size_type)DAEMON_SEND_SIZE), MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				return false;
+			ioctl(client.fd, SIOCOUTQ, &client.queued);
+			return true;
+		}
+		client.sent += n;
+		client.deadline = now + DAEMON_CLIENT_TIMEOUT;
+	}
+
+	return false;
+}
+
+bool pkgutild::reading(client_t& client, long long now) const
+{
+	// A client whose socket is full but which read some of it since it
+	// was last looked at is not dropped
+	int queued;
+	if (!client.answered || ioctl(client.fd, SIOCOUTQ, &queued) == -1 || queued >= client.queued)
+		return false;
+
+	client.queued = queued;
+	client.deadline = now + DAEMON_CLIENT_TIMEOUT;
+	return true;
+}
+
+void pkgutild::answer(const string& command, const string& arg, string& response)
+{
+	ostringstream out;
+
+	if (command == "installed") {
+		list_installed(out);
+	} else if (command == "list") {
+		if (!db_find_pkg(arg)) {
+			response = "missing\n";
+			return;
+		}
+		list_files(arg, out);
+	} else if (command == "owner") {
+		if (!list_owners(arg, out)) {
+			response = "missing\n";
+			return;
+		}
+	} else {
+		throw runtime_error("unknown request " + command);
+	}
+
+	// The length lets the client tell a complete answer from one that
+	// was cut short
+	const string listing = out.str();
+	ostringstream status;
+	status << "ok " << listing.size() << "\n";
+	response = status.str() + listing;
+}
+
+void pkgutild::print_help() const
+{
+	cout << "usage: " << utilname << " [options]" << endl
+	     << "options:" << endl
+	     << "  -r, --root <path>           specify alternative installation root" << endl
+	     << "  -v, --version               print version and exit" << endl
+	     << "  -h, --help                  print help and exit" << endl;
+}
@@ -0,0 +1,77 @@
+//
+//  pkgutils
+// 
+//  Copyright (c) 2000-2005 Per Liden
+//  Copyright (c) 2006-2007 by CRUX team (http://crux.nu)
+// 
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+//
+
+#ifndef PKGUTILD_H
+#define PKGUTILD_H
+
+#include "pkginfo.h"
+#include <csignal>
+
+#define DAEMON_REQUEST_MAX 65536
+#define DAEMON_CLIENT_TIMEOUT 1000
+#define DAEMON_CLIENTS_MAX 64
+#define DAEMON_SEND_SIZE 16384
+
+//
+// Keeps the package database of a root open and answers the queries of
+// pkginfo(8) over a Unix socket. The database is read again whenever it
+// changed since it was last read. Clients are read and written without
+// blocking, so one that is slow to send its request or to read the answer
+// does not hold up the others.
+//
+class pkgutild : public pkginfo {
+public:
+	pkgutild() : pkginfo("pkgutild"), loaded(false) {}
+	virtual void run(int argc, char** argv);
+	virtual void print_help() const;
+
+private:
+	// Connection of a client, dropped when it is not done by the deadline
+	struct client_t {
+		int fd;
+		string request;
+		string response;
+		string::size_type sent;
+		int queued;
+		bool answered;
+		long long deadline;
+	};
+
+	bool db_changed(struct stat& db_stat, struct stat& journal_stat) const;
+	bool db_reload();
+	bool receive(client_t& client, long long now);
+	bool transmit(client_t& client, long long now);
+	bool reading(client_t& client, long long now) const;
+	void answer(const string& command, const string& arg, string& response);
+
+	static void terminate(int signal);
+	static volatile sig_atomic_t terminated;
+
+	string db_root;
+	bool loaded;
+
+	// Database and journal as last read, zeroed when missing
+	struct stat db_read_stat;
+	struct stat journal_read_stat;
+};
+
+#endif /* PKGUTILD_H */